@@ -14,6 +14,7 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <ctype.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,10 +24,15 @@
 #include <time.h>
 #include <math.h>
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <sane/sane.h>
 
@@ -54,6 +60,12 @@
 #include <tiffio.h>
 #include <popt.h>
 #include <paper.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -67,7 +79,19 @@ enum optio
 
 #define BATCH_COUNT_UNLIMITED -1
 
+#define STREAM_TIFF	1
+#define STREAM_PNM	2
+#define STREAM_PAM	3
+
+struct device;
+
 static void tiffscan_exit(void);
+static void page_wait(struct device *dev);
+static int device_add(char *name);
+static void devices_cancel(void);
+static int stream_put_rows(TIFF *image, const SANE_Parameters *parm,
+			   const SANE_Byte *p, int lines);
+static double stats_clock(void);
 
 /*
 static SANE_Word tl_x = 0;
@@ -79,10 +103,42 @@ static SANE_Word h_y = 0;
 */
 
 /* main options */
-static char *devname = NULL;
 static int verbose = 0;
 static int progress = 0;
-static int scanlines = 200;
+static char *read_buffer = NULL;
+static int queue_depth = 4;
+static int rows_per_strip = -1;
+static int threads = -1;
+static int tiled = 0;
+static int write_buffer = 4096;
+static int direct_io = 0;
+static int max_memory = 0;	/* Mb, 0 is no limit */
+static int tile_size = 256;
+static int pyramid = 0;
+static int pyramid_levels = 0;
+static int show_stats = 0;
+static char *stats_json = NULL;
+static char *synthetic = NULL;
+static char *record_file = NULL;
+static char *replay_file = NULL;
+static double replay_speed = 0;	/* 0 is as fast as possible */
+static int interleave = 0;
+static int sample_bits = 16;
+static int output_depth = 0;
+static double output_gamma = 1.0;
+static char *byte_order = NULL;
+static char *codec_name = NULL;
+static int codec_level = -1;	/* the codec's own */
+static char *predictor_name = NULL;
+static double skip_blank = 0;
+static char *binarize_name = NULL;
+static int binarize_window = 0;
+static double binarize_k = 0;
+static int deskew = 0;
+static int autocrop = 0;
+static char *daemon_socket = NULL;
+static int cache_ttl = 3600;
+static int cache_refresh = 0;
 
 /* tiff tags */
 static const char *tiff_artist = NULL;
@@ -97,32 +153,52 @@ static int batch_prompt = 0;
 static int batch_amount = BATCH_COUNT_UNLIMITED;
 static int batch_start_at = 1;
 static int batch_increment = 1;
+static int resume = 0;
 
 /* output options */
 static char *output_file = NULL;
 static char *output_path = NULL;
+static char *stream_name = NULL;
+static int stream_format = 0;	/* STREAM_*, from --stream */
 static const char *icc_profile = NULL;
-static int compress = 1;
+static int compress_mode = 1;
 static int multi = 1;
 
 /* pdf options */
 
 static int pdf_mode = 0;
-static char *pdf_options = "-z -p a4";
 
 /* misc options */
 static const char *paper = NULL;
 
 /* globals */
-static SANE_Handle handle;
-static int batch_count = 0;
-static int resolution_optind = -1;
-static int corners[4];
-static char output_file_buf[34];
+static struct device *devices;	/* --device, in the order given */
+static int ndevices;
 #ifdef SANE_HAS_EVOLVED
 static SANE_Scanner_Info si;
 #endif
 
+/* where the image data comes from, the SANE device unless --synthetic or
+ * --replay
+ */
+struct source {
+	SANE_Status (*start)(SANE_Handle);
+	SANE_Status (*get_parameters)(SANE_Handle, SANE_Parameters *);
+	SANE_Status (*read)(SANE_Handle, SANE_Byte *, SANE_Int, SANE_Int *);
+	void (*cancel)(SANE_Handle);
+	void (*close)(SANE_Handle);
+};
+
+static const struct source sane_source = {
+	.start = sane_start,
+	.get_parameters = sane_get_parameters,
+	.read = sane_read,
+	.cancel = sane_cancel,
+	.close = sane_close,
+};
+
+static const struct source *source = &sane_source;
+
 static struct poptOption options[] = {
 	{"device", 'd', POPT_ARG_STRING, NULL, OPT_DEVICE, "device name", NULL},
 	{"scan", 's', POPT_ARG_NONE, NULL, OPT_SCAN,
@@ -145,12 +221,41 @@ static struct poptOption options[] = {
 	 "output file name, use %d to insert page number", "FILE"},
 	{"output-dir", 'O', POPT_ARG_STRING, &output_path, 0,
 	 "output directory path, will cwd to it", "PATH"},
+	{"stream", 0, POPT_ARG_STRING, &stream_name, 0,
+	 "write the pages one after the other to --output-file, a pipe or - for stdout (the default), messages go to stderr",
+	 "tiff|pnm|pam"},
 	{"multi-page", 0, POPT_BIT_SET | POPT_ARGFLAG_TOGGLE, &multi, 1,
 	 "create a multi-page TIFF file", NULL},
-	{"compress", 0, POPT_BIT_SET | POPT_ARGFLAG_TOGGLE, &compress, 1,
+	{"compress", 0, POPT_BIT_SET | POPT_ARGFLAG_TOGGLE, &compress_mode, 1,
 	 "use TIFF lossless compression", NULL},
+	{"codec", 0, POPT_ARG_STRING, &codec_name, 0,
+	 "TIFF compression, jpeg only for 8 bit gray and RGB (default: deflate, G4 for bilevel images)",
+	 "deflate|zstd|lzw|lzma|packbits|jpeg|none"},
+	{"codec-level", 0, POPT_ARG_INT, &codec_level, 0,
+	 "compression level, deflate 0-9 (0 stores the data uncompressed), zstd 1-22, lzma 0-9, or JPEG quality 1-100 (default: the codec's own, 75 for JPEG)", "N"},
+	{"predictor", 0, POPT_ARG_STRING, &predictor_name, 0,
+	 "TIFF predictor, auto uses horizontal differencing for 8 and 16 bit samples (default: auto)",
+	 "auto|none|horizontal|floating"},
 	{"icc-profile", 0, POPT_ARG_STRING, &icc_profile, 0,
 	 "embed an ICC profile in the TIFF file", "FILE"},
+	{"sample-bits", 0, POPT_ARG_INT, &sample_bits, 0,
+	 "significant bits of 16 bit samples, stretched to the full range (default: 16)", "N"},
+	{"output-depth", 0, POPT_ARG_INT, &output_depth, 0,
+	 "8 reduces 16 bit samples to 8 bits through the --gamma curve", "8|16"},
+	{"gamma", 0, POPT_ARG_DOUBLE, &output_gamma, 0,
+	 "gamma of the reduction to 8 bits (default: 1.0)", "G"},
+	{"byte-order", 0, POPT_ARG_STRING, &byte_order, 0,
+	 "byte order of the TIFF file (default: native)", "native|big|little"},
+	{"binarize", 0, POPT_ARG_STRING, &binarize_name, 0,
+	 "turn gray scans into bilevel images with an adaptive threshold", "sauvola|bradley"},
+	{"binarize-window", 0, POPT_ARG_INT, &binarize_window, 0,
+	 "side of the square the threshold is computed over (default: 1/8 inch)", "PIXELS"},
+	{"binarize-k", 0, POPT_ARG_DOUBLE, &binarize_k, 0,
+	 "sauvola k, or how much darker than its neighbourhood a bradley pixel must be (default: 0.34, 0.15)", "K"},
+	{"deskew", 0, POPT_ARG_NONE, &deskew, 0,
+	 "straighten pages skewed by up to 5 degrees", NULL},
+	{"autocrop", 0, POPT_ARG_NONE, &autocrop, 0,
+	 "crop the dark or light borders around the content of the page", NULL},
 
 	/* tiff tags */
 	{"artist", 0, POPT_ARG_STRING, &tiff_artist, 0,
@@ -175,10 +280,65 @@ static struct poptOption options[] = {
 	 "page number increment amount", NULL},
 	{"batch-prompt", 0, POPT_ARG_NONE, &batch_prompt, 0,
 	 "manual prompt before scanning", NULL},
+	{"skip-blank", 0, POPT_ARG_DOUBLE, &skip_blank, 0,
+	 "discard pages with less than PERCENT dark pixels", "PERCENT"},
+	{"resume", 0, POPT_ARG_NONE, &resume, 0,
+	 "go on with the batch writing to --output-file that did not end", NULL},
 
 	/* pdf options */
-	{"pdf", 0, POPT_ARG_NONE, &pdf_mode, 0, "invoke tiff2pdf on the scanned tiff file(s)", NULL},
-
+	{"pdf", 0, POPT_ARG_NONE, &pdf_mode, 0, "convert the scanned tiff file(s) to PDF", NULL},
+
+	/* performance options */
+	{"queue-depth", 0, POPT_ARG_INT, &queue_depth, 0,
+	 "buffers between the scanner and the TIFF encoder, 0 reads inline", "N"},
+	{"read-buffer", 0, POPT_ARG_STRING, &read_buffer, 0,
+	 "Kb asked of each read, adapted between MIN and MAX or fixed (default: 64:8192)",
+	 "MIN[:MAX]"},
+	{"rows-per-strip", 0, POPT_ARG_INT, &rows_per_strip, 0,
+	 "scanlines in each TIFF strip, 0 picks about 256 Kb per strip (default: 1, or 0 with --pdf)", "N"},
+	{"threads", 0, POPT_ARG_INT, &threads, 0,
+	 "strip compression threads, 0 compresses inline (default: one per CPU)", "N"},
+	{"write-buffer", 0, POPT_ARG_INT, &write_buffer, 0,
+	 "Kb gathered before writing to the TIFF file, 0 leaves the writes to libtiff (default: 4096)", "KB"},
+	{"direct-io", 0, POPT_ARG_NONE, &direct_io, 0,
+	 "write the TIFF file with O_DIRECT, bypassing the page cache", NULL},
+	{"max-memory", 0, POPT_ARG_INT, &max_memory, 0,
+	 "Mb the buffers of the scans may hold, the scanner is held back beyond that (default: no limit)", "MB"},
+	{"tiled", 0, POPT_ARG_NONE, &tiled, 0,
+	 "write tiles instead of strips, needs a known image height", NULL},
+	{"tile-size", 0, POPT_ARG_INT, &tile_size, 0,
+	 "tile width and height, a multiple of 16 (default: 256)", "N"},
+	{"pyramid", 0, POPT_ARG_NONE, &pyramid, 0,
+	 "store 1/2, 1/4, ... reduced resolution copies as SubIFDs", NULL},
+	{"pyramid-levels", 0, POPT_ARG_INT, &pyramid_levels, 0,
+	 "maximum number of reduced resolution copies (default: down to 256 pixels)", "N"},
+	{"stats", 0, POPT_ARG_NONE, &show_stats, 0,
+	 "print timings and sizes of each page and of the batch", NULL},
+	{"stats-json", 0, POPT_ARG_STRING, &stats_json, 0,
+	 "write the statistics as JSON, one object per line, - is stdout", "FILE"},
+	{"interleave", 0, POPT_ARG_NONE, &interleave, 0,
+	 "interleave the planes of three-pass scanners instead of writing them separately", NULL},
+	{"synthetic", 0, POPT_ARG_STRING, &synthetic, 0,
+	 "scan generated images instead of using a device, for benchmarks",
+	 "FORMAT:DEPTH:WIDTHxLINES[:CHUNK[:PAGES]]"},
+	{"record", 0, POPT_ARG_STRING, &record_file, 0,
+	 "keep the parameters and data sent by the device, with their timing, in FILE", "FILE"},
+	{"replay", 0, POPT_ARG_STRING, &replay_file, 0,
+	 "scan from a --record file instead of using a device", "FILE"},
+	{"replay-speed", 0, POPT_ARG_DOUBLE, &replay_speed, 0,
+	 "1 replays at the recorded speed, 2 twice as fast (default: 0, as fast as possible)", "X"},
+
+	/* daemon options */
+	{"daemon", 0, POPT_ARG_STRING, &daemon_socket, 0,
+	 "keep the device open and run the scans sent with --connect", "SOCKET"},
+	{"connect", 0, POPT_ARG_STRING, NULL, 0,
+	 "run this scan on the tiffscan --daemon listening on SOCKET", "SOCKET"},
+
+	/* cache options */
+	{"cache-ttl", 0, POPT_ARG_INT, &cache_ttl, 0,
+	 "seconds the devices and their options are remembered, 0 disables the cache (default: 3600)", "SECONDS"},
+	{"refresh", 0, POPT_ARG_NONE, &cache_refresh, 0,
+	 "look for the devices and their options again, ignoring the cache", NULL},
 
 	/* other options */
 	{"paper", 0, POPT_ARG_STRING, &paper, 0,
@@ -193,12 +353,12 @@ sighandler(int signum)
 {
 	static SANE_Bool first_time = SANE_TRUE;
 
-	if (handle) {
+	if (ndevices) {
 		printf("\nreceived signal %d\n", signum);
 		if (first_time) {
 			first_time = SANE_FALSE;
 			printf("trying to stop the scanner, one more CTRL-C will exit tiffscan.\n");
-			sane_cancel(handle);
+			devices_cancel();
 		} else {
 			printf("aborting\n");
 			_exit(0);
@@ -243,7 +403,7 @@ parse_scalar(const SANE_Option_Descriptor * opt,
 	if (str == end) {
 		printf("option --%s: bad option value (rest of option: %s)\n",
 		       opt->name, str);
-		exit(1);
+		return NULL;
 	}
 	str = end;
 
@@ -319,8 +479,7 @@ parse_scalar(const SANE_Option_Descriptor * opt,
  *
  */
 
-/* XXX exit is not appropriate in this func */
-static void
+static int
 parse_vector(const SANE_Option_Descriptor * opt,
 	     const char *str, SANE_Word * vector, size_t vector_length)
 {
@@ -339,7 +498,7 @@ parse_vector(const SANE_Option_Descriptor * opt,
 				printf("option --%s: closing bracket missing "
 				       "(rest of option: %s)\n", opt->name,
 				       str);
-				exit(1);
+				return -1;
 			}
 			str = end + 1;
 		} else
@@ -347,17 +506,17 @@ parse_vector(const SANE_Option_Descriptor * opt,
 
 		if (index < 0 || index >= (int) vector_length) {
 			printf("option --%s: index %d out of range [0..%ld]\n", opt->name, index, (long) vector_length - 1);
-			exit(1);
+			return -1;
 		}
 
 		/* read value */
 		str = parse_scalar(opt, str, &value);
 		if (!str)
-			exit(1);
+			return -1;
 
 		if (*str && *str != '-' && *str != ',') {
 			printf("option --%s: illegal separator (rest of option: %s)\n", opt->name, str);
-			exit(1);
+			return -1;
 		}
 
 		/* store value: */
@@ -393,6 +552,8 @@ parse_vector(const SANE_Option_Descriptor * opt,
 				printf("%d ", vector[i]);
 		fputc('\n', stdout);
 	}
+
+	return 0;
 }
 
 /* XXX move to strings.c */
@@ -530,7 +691,8 @@ add_default_option(char **dst, SANE_Handle handle,
 }
 
 static void
-track_corners(const int index, const SANE_Option_Descriptor * opt)
+track_corners(int *corners, const int index,
+	      const SANE_Option_Descriptor * opt)
 {
 	/* XXX only SANE_TYPE_FIXED right now */
 /*	if (!(opt->type == SANE_TYPE_FIXED || opt->type == SANE_TYPE_INT)) */
@@ -556,7 +718,7 @@ track_corners(const int index, const SANE_Option_Descriptor * opt)
 }
 
 static struct poptOption *
-fetch_options(SANE_Handle handle)
+fetch_options(SANE_Handle handle, int *resolution_optind, int *corners)
 {
 	SANE_Status status;
 	struct poptOption *options;
@@ -566,7 +728,7 @@ fetch_options(SANE_Handle handle)
 	int i, count;
 
 	/* init corners tracking */
-	memset(corners, -1, sizeof(corners));
+	memset(corners, -1, 4 * sizeof(*corners));
 
 	/* query number of options */
 	status = sane_control_option(handle, 0, SANE_ACTION_GET_VALUE,
@@ -604,7 +766,7 @@ fetch_options(SANE_Handle handle)
 		    && opt->size == sizeof(SANE_Int)
 		    && (opt->unit == SANE_UNIT_DPI)
 		    && (strcmp(opt->name, SANE_NAME_SCAN_RESOLUTION) == 0))
-			resolution_optind = i;
+			*resolution_optind = i;
 
 		thisopt->longName = opt->name ? opt->name : "unknown";
 		thisopt->shortName = 0;
@@ -752,7 +914,7 @@ fetch_options(SANE_Handle handle)
 		count++;
 
 		/* Keep track of corner options */
-		track_corners(i, opt);
+		track_corners(corners, i, opt);
 	}
 
 	return options;
@@ -799,6 +961,38 @@ sane_set_opt_word(SANE_Handle handle, SANE_Word index, double v)
 
 #define ADF_STR "Automatic Document Feeder"
 
+/* setting an option can take a while on network and USB backends, and
+ * a --daemon job repeats most of them. Options left to the backend
+ * (auto) are always set.
+ */
+static int
+option_unchanged(SANE_Handle handle, int optnum,
+		 const SANE_Option_Descriptor *opt, const void *valuep)
+{
+	void *cur;
+	int same;
+
+	if (opt->type == SANE_TYPE_BUTTON || opt->size <= 0
+	    || (opt->cap & SANE_CAP_AUTOMATIC))
+		return 0;
+
+	cur = malloc(opt->size);
+	if (cur == NULL)
+		return 0;
+
+	if (sane_control_option(handle, optnum, SANE_ACTION_GET_VALUE,
+				cur, 0) != SANE_STATUS_GOOD)
+		same = 0;
+	else if (opt->type == SANE_TYPE_STRING)
+		same = strncmp(cur, valuep, opt->size) == 0;
+	else
+		same = memcmp(cur, valuep, opt->size) == 0;
+
+	free(cur);
+
+	return same;
+}
+
 static SANE_Status
 set_option(SANE_Handle handle, int optnum, void *valuep)
 {
@@ -817,6 +1011,8 @@ set_option(SANE_Handle handle, int optnum, void *valuep)
 		}
 	}
 
+	if (option_unchanged(handle, optnum, opt, valuep))
+		return SANE_STATUS_GOOD;
 
 	if (opt->type == SANE_TYPE_INT && opt->size == sizeof(SANE_Word))
 		status = sane_set_opt_word(handle, optnum,
@@ -910,7 +1106,8 @@ process_backend_option(SANE_Handle handle, int optnum, const char *optarg)
 				return SANE_STATUS_NO_MEM;
 			}
 		}
-		parse_vector(opt, optarg, vector, vector_length);
+		if (parse_vector(opt, optarg, vector, vector_length) != 0)
+			return SANE_STATUS_INVAL;
 		valuep = vector;
 		break;
 
@@ -1055,21 +1252,281 @@ tiff_set_hostcomputer(TIFF * image)
 }
 
 
+/* the --codec-level each takes, none when max_level is -1 */
+static const struct {
+	const char *name;
+	int compression;
+	int min_level;
+	int max_level;
+} tiff_codecs[] = {
+	{ "deflate", COMPRESSION_DEFLATE, 0, 9 },
+#ifdef COMPRESSION_ZSTD
+	{ "zstd", COMPRESSION_ZSTD, 1, 22 },
+#endif
+	{ "lzw", COMPRESSION_LZW, -1, -1 },
+#ifdef COMPRESSION_LZMA
+	{ "lzma", COMPRESSION_LZMA, 0, 9 },
+#endif
+	{ "packbits", COMPRESSION_PACKBITS, -1, -1 },
+	{ "jpeg", COMPRESSION_JPEG, 1, 100 },
+	{ "none", COMPRESSION_NONE, -1, -1 },
+};
+
+#define JPEG_QUALITY 75
+
+static int tiff_codec = -1;		/* -1 picks deflate or G4 */
+static int tiff_predictor_mode = -1;	/* -1 is auto */
+
+/* check --codec, --codec-level and --predictor against what libtiff
+ * was built with
+ */
+static int
+tiff_codec_init(void)
+{
+	unsigned int i, codec = 0;	/* deflate unless asked */
+
+	tiff_codec = -1;
+	tiff_predictor_mode = -1;
+
+	if (codec_name) {
+		for (i = 0; i < ARRAY_SIZE(tiff_codecs); i++)
+			if (strcmp(codec_name, tiff_codecs[i].name) == 0) {
+				tiff_codec = tiff_codecs[i].compression;
+				codec = i;
+			}
+
+		if (tiff_codec < 0) {
+			printf("unknown codec: %s\n", codec_name);
+			return -1;
+		}
+
+		if (tiff_codec != COMPRESSION_NONE
+		    && !TIFFIsCODECConfigured(tiff_codec)) {
+			printf("libtiff has no %s support\n", codec_name);
+			return -1;
+		}
+	}
+
+	/* -1 is the codec's own */
+	if (codec_level != -1 && tiff_codecs[codec].max_level < 0) {
+		printf("%s has no compression level\n", tiff_codecs[codec].name);
+		return -1;
+	}
+
+	if (codec_level != -1 && (codec_level < tiff_codecs[codec].min_level
+	    || codec_level > tiff_codecs[codec].max_level)) {
+		printf("%s compression levels go from %d to %d\n",
+		       tiff_codecs[codec].name, tiff_codecs[codec].min_level,
+		       tiff_codecs[codec].max_level);
+		return -1;
+	}
+
+	if (predictor_name == NULL || strcmp(predictor_name, "auto") == 0)
+		return 0;
+
+	if (strcmp(predictor_name, "none") == 0) {
+		tiff_predictor_mode = PREDICTOR_NONE;
+	} else if (strcmp(predictor_name, "horizontal") == 0) {
+		tiff_predictor_mode = PREDICTOR_HORIZONTAL;
+	} else if (strcmp(predictor_name, "floating") == 0) {
+		/* SANE has no floating point frames */
+		printf("the floating point predictor needs floating point "
+		       "samples, scanners deliver integers\n");
+		return -1;
+	} else {
+		printf("unknown predictor: %s\n", predictor_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+tiff_compression(const SANE_Parameters * parm)
+{
+	if (!compress_mode)
+		return COMPRESSION_NONE;
+
+	/* anything JPEG cannot take is compressed losslessly */
+	if (tiff_codec == COMPRESSION_JPEG && (parm->depth != 8
+	    || (parm->format != SANE_FRAME_GRAY
+		&& parm->format != SANE_FRAME_RGB)))
+		return parm->depth == 1 ? COMPRESSION_CCITTFAX4
+			: COMPRESSION_DEFLATE;
+
+	if (tiff_codec >= 0)
+		return tiff_codec;
+
+	if (parm->depth == 1)
+		return COMPRESSION_CCITTFAX4;
+
+	return COMPRESSION_DEFLATE;
+}
+
+/* JPEG strips are made of whole 16 row MCUs, the last one aside */
+static int
+tiff_round_rows(const SANE_Parameters * parm, int rows)
+{
+	if (tiff_compression(parm) == COMPRESSION_JPEG)
+		return (rows + 15) & ~15;
+	return rows;
+}
+
+/* differencing only helps continuous tone images, and only the
+ * dictionary and entropy coders know about it
+ */
+static int
+tiff_predictor(const SANE_Parameters * parm)
+{
+	if (parm->depth < 8)
+		return PREDICTOR_NONE;
+
+	switch (tiff_compression(parm)) {
+	case COMPRESSION_DEFLATE:
+	case COMPRESSION_ADOBE_DEFLATE:
+	case COMPRESSION_LZW:
+#ifdef COMPRESSION_ZSTD
+	case COMPRESSION_ZSTD:
+#endif
+#ifdef COMPRESSION_LZMA
+	case COMPRESSION_LZMA:
+#endif
+		break;
+
+	default:
+		return PREDICTOR_NONE;
+	}
+
+	return tiff_predictor_mode < 0 ? PREDICTOR_HORIZONTAL
+		: tiff_predictor_mode;
+}
+
+/* the level is a codec pseudo tag, valid once the codec is set. it was
+ * checked for --codec, not for what images JPEG cannot take fall back to
+ */
+static void
+tiff_set_codec_level(TIFF * image, int compression)
+{
+	if (codec_level < 0 || (tiff_codec >= 0 && compression != tiff_codec))
+		return;
+
+	switch (compression) {
+	case COMPRESSION_DEFLATE:
+	case COMPRESSION_ADOBE_DEFLATE:
+		TIFFSetField(image, TIFFTAG_ZIPQUALITY, codec_level);
+		break;
+#ifdef TIFFTAG_ZSTD_LEVEL
+	case COMPRESSION_ZSTD:
+		TIFFSetField(image, TIFFTAG_ZSTD_LEVEL, codec_level);
+		break;
+#endif
+#ifdef TIFFTAG_LZMAPRESET
+	case COMPRESSION_LZMA:
+		TIFFSetField(image, TIFFTAG_LZMAPRESET, codec_level);
+		break;
+#endif
+	}
+}
+
+/* RGB goes in as YCbCr with 2x2 chroma subsampling. every strip carries
+ * its own tables, so that the strips can be encoded apart from the file
+ * and copied into a PDF as they are.
+ */
 static void
-tiff_set_fields(TIFF * image, SANE_Parameters * parm, int resolution)
+tiff_set_jpeg(TIFF * image, const SANE_Parameters * parm)
 {
-	char buf[20];
-	time_t now = time(NULL);
+	float refbw[6] = { 0, 255, 128, 255, 128, 255 };
 
-	strftime((char *) buf, 20, "%Y:%m:%d %H:%M:%S", localtime(&now));
+	if (parm->format == SANE_FRAME_RGB) {
+		TIFFSetField(image, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_YCBCR);
+		TIFFSetField(image, TIFFTAG_YCBCRSUBSAMPLING, 2, 2);
+		TIFFSetField(image, TIFFTAG_REFERENCEBLACKWHITE, refbw);
+		TIFFSetField(image, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+	}
 
-	TIFFSetField(image, TIFFTAG_DATETIME, buf);
+	TIFFSetField(image, TIFFTAG_JPEGQUALITY,
+		     codec_level >= 0 ? codec_level : JPEG_QUALITY);
+	TIFFSetField(image, TIFFTAG_JPEGTABLESMODE, 0);
+}
 
-	/* setup header. height will be dynamically incremented */
+/* libtiff open flag for the byte order asked for */
+static const char *
+tiff_byte_order(void)
+{
+	if (byte_order && strcmp(byte_order, "big") == 0)
+		return "b";
+
+	if (byte_order && strcmp(byte_order, "little") == 0)
+		return "l";
+
+	return "";
+}
+
+/* whether 16 bit samples must be swapped on their way to the file */
+static int
+tiff_swab(void)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return *tiff_byte_order() == 'b';
+#else
+	return *tiff_byte_order() == 'l';
+#endif
+}
+
+/* strips of roughly 256 Kb compress well and keep all the workers busy */
+#define STRIP_AUTO_SIZE (256 * 1024)
+
+static int
+tiff_rows_per_strip(const SANE_Parameters * parm)
+{
+	int rows = rows_per_strip;
+
+	/* unless told otherwise, give the PDF writer strips to embed */
+	if (rows < 0)
+		rows = pdf_mode ? 0 : 1;
+
+	if (rows == 0)
+		rows = STRIP_AUTO_SIZE / parm->bytes_per_line;
+
+	rows = tiff_round_rows(parm, rows);
+
+	if (parm->lines > 0 && rows > parm->lines)
+		rows = parm->lines;
+
+	return rows > 0 ? rows : 1;
+}
+
+static int
+tiff_samples(const SANE_Parameters * parm)
+{
+	return ((8 * parm->bytes_per_line) / parm->pixels_per_line)
+		/ parm->depth;
+}
+
+/* tiles need the number of lines in advance */
+static int
+tiff_tiled(const SANE_Parameters * parm)
+{
+	return tiled && parm->lines > 0;
+}
+
+static int
+tiff_tile_size(void)
+{
+	if (tile_size < 16)
+		return 16;
+
+	return (tile_size + 15) & ~15;
+}
 
+/* the fields that describe the sample layout and its encoding. these
+ * are shared by the output file and by the strip encoders.
+ */
+static void
+tiff_set_format(TIFF * image, const SANE_Parameters * parm)
+{
 	TIFFSetField(image, TIFFTAG_IMAGEWIDTH, parm->pixels_per_line);
 	TIFFSetField(image, TIFFTAG_BITSPERSAMPLE, parm->depth);
-	TIFFSetField(image, TIFFTAG_ROWSPERSTRIP, 1);
 
 	if (parm->depth == 1) {
 		TIFFSetField(image, TIFFTAG_SAMPLESPERPIXEL, 1);
@@ -1079,8 +1536,7 @@ tiff_set_fields(TIFF * image, SANE_Parameters * parm, int resolution)
 			THRESHHOLD_BILEVEL);
 	} else {
 		TIFFSetField(image, TIFFTAG_SAMPLESPERPIXEL,
-			     ((8 * parm->bytes_per_line) /
-			      parm->pixels_per_line) / parm->depth);
+			     tiff_samples(parm));
 
 		if (parm->format == SANE_FRAME_GRAY) {
 			TIFFSetField(image, TIFFTAG_PHOTOMETRIC,
@@ -1105,17 +1561,49 @@ tiff_set_fields(TIFF * image, SANE_Parameters * parm, int resolution)
 
 	}
 
-	if (compress) {
-		if (parm->depth == 1)
-			TIFFSetField(image, TIFFTAG_COMPRESSION,
-				     COMPRESSION_CCITTFAX4);
-		else
-			TIFFSetField(image, TIFFTAG_COMPRESSION,
-				     COMPRESSION_DEFLATE);
+	if (compress_mode) {
+		int compression = tiff_compression(parm);
+		int predictor = tiff_predictor(parm);
+
+		TIFFSetField(image, TIFFTAG_COMPRESSION, compression);
+		tiff_set_codec_level(image, compression);
+
+		if (compression == COMPRESSION_JPEG)
+			tiff_set_jpeg(image, parm);
+
+		if (predictor != PREDICTOR_NONE)
+			TIFFSetField(image, TIFFTAG_PREDICTOR, predictor);
 	}
 
 	TIFFSetField(image, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);
 	TIFFSetField(image, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+}
+
+static void
+tiff_set_fields(TIFF * image, SANE_Parameters * parm, int resolution)
+{
+	char buf[20];
+	time_t now = time(NULL);
+	struct tm tm;
+
+	/* devices scan at once */
+	strftime((char *) buf, 20, "%Y:%m:%d %H:%M:%S",
+		 localtime_r(&now, &tm));
+
+	TIFFSetField(image, TIFFTAG_DATETIME, buf);
+
+	/* setup header. height will be dynamically incremented */
+
+	tiff_set_format(image, parm);
+
+	if (tiff_tiled(parm)) {
+		TIFFSetField(image, TIFFTAG_IMAGELENGTH, parm->lines);
+		TIFFSetField(image, TIFFTAG_TILEWIDTH, tiff_tile_size());
+		TIFFSetField(image, TIFFTAG_TILELENGTH, tiff_tile_size());
+	} else {
+		TIFFSetField(image, TIFFTAG_ROWSPERSTRIP,
+			     tiff_rows_per_strip(parm));
+	}
 
 	TIFFSetField(image, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH);
 	TIFFSetField(image, TIFFTAG_XRESOLUTION, (float) resolution);
@@ -1192,731 +1680,8339 @@ format2name(SANE_Frame format)
 #pragma GCC diagnostic pop
 }
 
+/* XXX synthetic.c */
+
+/* A generator standing in for the scanner, so the encoding path can be
+ * benchmarked without one. Pages are a gradient with some noise, or
+ * sparse black specks at 1 bit, cycling over a few rows so that making
+ * them costs little more than a memcpy().
+ */
+
+#define SYNTHETIC_ROWS		61	/* rows before the pattern repeats */
+#define SYNTHETIC_CHUNK		32768
+#define SYNTHETIC_RESOLUTION	300
+
+struct synthetic {
+	SANE_Parameters parm;
+	int chunk;
+	int pages;		/* left to start */
+	unsigned char *pattern;
+	size_t pattern_size;
+	size_t pos, size;	/* in the current page */
+};
 
 static SANE_Status
-scan_to_tiff(TIFF *image, int pageno, int pages, int resolution)
+synthetic_start(SANE_Handle h)
 {
-	int rows = 0;
-	int tries = 4;
-	int len, hundred_percent;
+	struct synthetic *sy = h;
 
-/* XXX	SANE_Byte min = 0xff, max = 0; */
-	SANE_Parameters parm;
-	SANE_Status status;
-	SANE_Word total_bytes = 0, expected_bytes;
+	if (sy->pages == 0)
+		return SANE_STATUS_NO_DOCS;
 
-	SANE_Byte *buffer;
-	size_t buffer_size;
+	sy->pages--;
+	sy->pos = 0;
+	sy->size = (size_t) sy->parm.bytes_per_line * sy->parm.lines;
 
-#ifdef SANE_HAS_WARMING_UP
-scan:
-#endif
-	if (tries == 0) {
-		printf("Your scanner must be frozen, will not try again :)\n");
-		return SANE_STATUS_IO_ERROR;
-	}
+	return SANE_STATUS_GOOD;
+}
 
-	status = sane_start(handle);
+static SANE_Status
+synthetic_get_parameters(SANE_Handle h, SANE_Parameters *parm)
+{
+	struct synthetic *sy = h;
 
-	/* return immediately when no docs are available */
-	if (status == SANE_STATUS_NO_DOCS)
-		return status;
+	*parm = sy->parm;
 
-#ifdef SANE_HAS_WARMING_UP
-	if (status == SANE_STATUS_WARMING_UP) {
-		tries--;
-		printf("The scanner is warming up, will retry in 15 seconds...\n");
-		sleep(15);
-		goto scan;
-	}
-#endif
-	if (status != SANE_STATUS_GOOD) {
-		printf("sane_start: %s\n", sane_strstatus(status));
-		return status;
-	}
+	return SANE_STATUS_GOOD;
+}
 
-	status = sane_get_parameters(handle, &parm);
-	if (status != SANE_STATUS_GOOD) {
-		printf("sane_get_parameters: %s\n", sane_strstatus(status));
-		return status;
-	}
+static SANE_Status
+synthetic_read(SANE_Handle h, SANE_Byte *data, SANE_Int max_length,
+	       SANE_Int *length)
+{
+	struct synthetic *sy = h;
+	size_t len = sy->size - sy->pos;
 
-	if (verbose) {
-		if (parm.lines >= 0) {
-			printf("scanning %s image of size %dx%d pixels at "
-			       "%d bits/pixel\n",
-			       format2name(parm.format),
-			       parm.pixels_per_line, parm.lines,
-			       8 * parm.bytes_per_line /
-			       parm.pixels_per_line);
-		} else {
-			printf("scanning %s image %d pixels wide and "
-			       "variable height at %d bits/pixel\n",
-			       format2name(parm.format),
-			       parm.pixels_per_line,
-			       8 * parm.bytes_per_line /
-			       parm.pixels_per_line);
-		}
-	}
+	*length = 0;
 
-	/* check format */
-	if (!check_sane_format(&parm))
-		return SANE_STATUS_INVAL;
+	if (len == 0)
+		return SANE_STATUS_EOF;
 
-	hundred_percent = parm.bytes_per_line * parm.lines;
-	/* XXX
-	   switch (parm.format) {
-	   case SANE_FRAME_RGB:
-	   case SANE_FRAME_GRAY:
-	   break;
+	if (len > (size_t) max_length)
+		len = max_length;
+	if (len > (size_t) sy->chunk)
+		len = sy->chunk;
 
+	*length = len;
 
-	   }
+	while (len) {
+		size_t off = sy->pos % sy->pattern_size;
+		size_t n = sy->pattern_size - off;
 
-	   *
-	   ((parm.format == SANE_FRAME_RGB
-	   || parm.format == SANE_FRAME_GRAY) ? 1 : 3);
-	 */
+		if (n > len)
+			n = len;
 
-	buffer_size = scanlines * parm.bytes_per_line;
+		memcpy(data, sy->pattern + off, n);
 
-	if (verbose > 1) {
-		printf("working on a %ld Kb buffer that holds %d scanlines\n",
-			buffer_size / 1024,
-			scanlines);
+		data += n;
+		sy->pos += n;
+		len -= n;
 	}
 
+	return SANE_STATUS_GOOD;
+}
 
-	buffer = malloc(buffer_size);
-	if (buffer == NULL)
-		return SANE_STATUS_NO_MEM;
+static void
+synthetic_cancel(SANE_Handle h)
+{
+	struct synthetic *sy = h;
 
-	while (1) {
-		double progr;
+	sy->size = sy->pos;
+}
 
-		/* read from SANE */
-		status = sane_read(handle, buffer, buffer_size, &len);
-		if (status == SANE_STATUS_EOF)
-			break;
+static void
+synthetic_close(SANE_Handle h)
+{
+	struct synthetic *sy = h;
 
-		if (status != SANE_STATUS_GOOD) {
-			if (verbose) {
-				printf("sane_read: %s\n", sane_strstatus(status));
-			}
-			break;
-		}
+	free(sy->pattern);
+	free(sy);
+}
 
-		/* no data? keep reading */
-		if (len == 0)
-			continue;
+static const struct source synthetic_source = {
+	.start = synthetic_start,
+	.get_parameters = synthetic_get_parameters,
+	.read = synthetic_read,
+	.cancel = synthetic_cancel,
+	.close = synthetic_close,
+};
 
-		/* got some data, prepare tiff directory */
-		if (TIFFCurrentRow(image) == -1) {
+/* FORMAT:DEPTH:WIDTHxLINES[:CHUNK[:PAGES]], e.g. rgb:16:5100x7000 */
+static SANE_Handle
+synthetic_open(const char *spec)
+{
+	struct synthetic *sy;
+	char format[8];
+	int depth, width, lines, chunk = SYNTHETIC_CHUNK, pages = 1;
+	int samples;
+	uint32_t seed = 0x2545f491;
+	size_t i;
+
+	if (sscanf(spec, "%7[a-z]:%d:%dx%d:%d:%d", format, &depth, &width,
+		   &lines, &chunk, &pages) < 4
+	    || width <= 0 || lines <= 0 || chunk <= 0 || pages <= 0) {
+		printf("bad synthetic source: %s\n", spec);
+		return NULL;
+	}
 
-			tiff_set_fields(image, &parm, resolution);
-			tiff_set_user_fields(image);
-			tiff_set_hostcomputer(image);
+	sy = calloc(1, sizeof(*sy));
+	if (sy == NULL)
+		return NULL;
 
-			if (pageno && batch) {
-				TIFFSetField(image, TIFFTAG_PAGENUMBER, pageno, pages);
-			}
-		}
+	if (strcmp(format, "gray") == 0) {
+		sy->parm.format = SANE_FRAME_GRAY;
+		samples = 1;
+	} else if (strcmp(format, "rgb") == 0) {
+		sy->parm.format = SANE_FRAME_RGB;
+		samples = 3;
+	} else if (strcmp(format, "rgbi") == 0) {
+		sy->parm.format = SANE_FRAME_RGBI;
+		samples = 4;
+	} else {
+		printf("unknown synthetic format %s, use gray, rgb or rgbi\n",
+		       format);
+		free(sy);
+		return NULL;
+	}
 
-		total_bytes += (SANE_Word) len;
-		progr = ((total_bytes * 100.) / (double) hundred_percent);
-		if (progr > 100.)
-			progr = 100.;
-		if (progress)
-			printf("progress: %3.1f%%\r", progr);
+	sy->parm.last_frame = SANE_TRUE;
+	sy->parm.depth = depth;
+	sy->parm.pixels_per_line = width;
+	sy->parm.lines = lines;
+	sy->parm.bytes_per_line = ((size_t) width * samples * depth + 7) / 8;
 
-		/* write to file */
-		{
-			int i;
-			unsigned char *p = buffer;
-			int lines = len / parm.bytes_per_line;
+	if (!check_sane_format(&sy->parm)) {
+		printf("unsupported synthetic format %s at %d bits\n",
+		       format, depth);
+		free(sy);
+		return NULL;
+	}
 
-			/* Write each scanline */
-			for (i = 0; i < lines; i++) {
-				TIFFWriteScanline(image, p, rows++, 0);
-				p += parm.bytes_per_line;
-			}
-		}
+	sy->chunk = chunk;
+	sy->pages = pages;
+	sy->pattern_size = (size_t) sy->parm.bytes_per_line * SYNTHETIC_ROWS;
+	sy->pattern = malloc(sy->pattern_size);
+	if (sy->pattern == NULL) {
+		free(sy);
+		return NULL;
 	}
 
-	expected_bytes = parm.bytes_per_line * parm.lines;
-	/* *
-	   ((parm.format == SANE_FRAME_RGB
-	   || parm.format == SANE_FRAME_GRAY) ? 1 : 3);
-	 */
+	for (i = 0; i < sy->pattern_size; i++) {
+		size_t row = i / sy->parm.bytes_per_line;
+		size_t col = i % sy->parm.bytes_per_line;
 
-	if (parm.lines < 0)
-		expected_bytes = 0;
+		/* xorshift */
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
 
-	if (total_bytes > expected_bytes && expected_bytes != 0) {
-		printf("WARNING: read more data than announced by backend "
-		       "(%u/%u)\n", total_bytes, expected_bytes);
-	} else if (verbose > 1)
-		printf("read %u bytes in total\n", total_bytes);
+		if (depth == 1)
+			sy->pattern[i] = (seed & 0x3f) ? 0x00 : seed >> 24;
+		else
+			sy->pattern[i] = (col / samples + row) / 4
+				+ (seed & 0x07);
+	}
 
-	return status;
+	return sy;
 }
 
-static int
-get_resolution(SANE_Handle handle)
-{
-	const SANE_Option_Descriptor *resopt;
-	int resol = 0;
-	void *val;
+/* XXX record.c */
 
-	if (resolution_optind < 0)
-		return 0;
+/* --record keeps what the scanner said during a scan: its parameters, the
+ * status of each call and every chunk read, with the time each call took.
+ * --replay then stands in for the scanner with the file, mapped in memory,
+ * as fast as possible or at the recorded pace, so that a scan that went
+ * wrong, or a slow one, can be run again through the whole pipeline.
+ *
+ * The file is a header followed by events in host byte order, each one
+ * followed by its data padded to 8 bytes.
+ */
 
-	resopt = sane_get_option_descriptor(handle, resolution_optind);
-	if (!resopt)
-		return 0;
+#define RECORD_MAGIC	"tiffscan"
+#define RECORD_VERSION	1
 
-	val = malloc(resopt->size);
-	if (val == NULL)
-		return 0;
+#define RECORD_START	1	/* sane_start() */
+#define RECORD_PARAMS	2	/* sane_get_parameters(), struct record_params */
+#define RECORD_READ	3	/* sane_read(), the bytes read */
 
-	sane_control_option(handle, resolution_optind,
-			    SANE_ACTION_GET_VALUE, val, 0);
-	if (resopt->type == SANE_TYPE_INT)
-		resol = *(SANE_Int *) val;
-	else
-		resol = (int) (SANE_UNFIX(*(SANE_Fixed *) val) + 0.5);
+struct record_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t resolution;
+};
 
-	free(val);
+struct record_event {
+	uint16_t type;		/* RECORD_* */
+	int16_t status;		/* returned by the call */
+	uint32_t len;		/* of the data that follows */
+	uint64_t ns;		/* spent in the call */
+};
 
-	return resol;
-}
+/* SANE_Parameters, whatever the size of SANE_Bool and SANE_Int */
+struct record_params {
+	int32_t format;
+	int32_t last_frame;
+	int32_t bytes_per_line;
+	int32_t pixels_per_line;
+	int32_t lines;
+	int32_t depth;
+};
+
+static FILE *record_fp;
+static const struct source *record_inner;	/* the one recorded */
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static int record_error;
 
 static void
-tiffscan_exit(void)
+record_event(int type, SANE_Status status, const void *data, uint32_t len,
+	     double t0)
 {
-	if (handle) {
-		if (verbose > 1)
-			printf("closing device\n");
-		sane_close(handle);
-	}
+	static const char pad[8];
+	struct record_event ev;
+	size_t padding = (8 - len % 8) % 8;
+
+	memset(&ev, 0x00, sizeof(ev));
+	ev.type = type;
+	ev.status = status;
+	ev.len = len;
+	ev.ns = (stats_clock() - t0) * 1e9;
+
+	pthread_mutex_lock(&record_lock);
+	if (fwrite(&ev, sizeof(ev), 1, record_fp) != 1
+	    || fwrite(data, 1, len, record_fp) != len
+	    || fwrite(pad, 1, padding, record_fp) != padding)
+		record_error = 1;
+	pthread_mutex_unlock(&record_lock);
+}
 
-	sane_exit();
+static SANE_Status
+record_start(SANE_Handle h)
+{
+	double t0 = stats_clock();
+	SANE_Status status = record_inner->start(h);
 
-	paperdone();
+	record_event(RECORD_START, status, NULL, 0, t0);
 
-	if (verbose)
-		printf("done.\n");
+	return status;
 }
 
-static void
-list_devices(void)
+static SANE_Status
+record_get_parameters(SANE_Handle h, SANE_Parameters *parm)
 {
-	int i;
-	const SANE_Device **device_list;
-	SANE_Status status;
+	double t0 = stats_clock();
+	SANE_Status status = record_inner->get_parameters(h, parm);
+	struct record_params rp;
 
-	status = sane_get_devices(&device_list, SANE_FALSE);
-	if (status != SANE_STATUS_GOOD) {
-		printf("sane_get_devices() failed: %s\n",
-		       sane_strstatus(status));
-		return;
-	}
+	rp.format = parm->format;
+	rp.last_frame = parm->last_frame;
+	rp.bytes_per_line = parm->bytes_per_line;
+	rp.pixels_per_line = parm->pixels_per_line;
+	rp.lines = parm->lines;
+	rp.depth = parm->depth;
 
-	for (i = 0; device_list[i]; i++) {
-		printf("device '%s' is a %s %s %s\n",
-		       device_list[i]->name,
-		       device_list[i]->vendor,
-		       device_list[i]->model, device_list[i]->type);
-	}
+	record_event(RECORD_PARAMS, status, &rp, sizeof(rp), t0);
 
-	if (i == 0) {
-		printf("\nNo scanners were identified. If you were expecting "
-		       "something different,\ncheck that the scanner is plugged "
-		       "in, turned on and detected by the\nsane-find-scanner tool "
-		       "(if appropriate). Please read the documentation\nwhich came "
-		       "SANE (README, FAQ, manpages).\n");
-	}
+	return status;
 }
 
-/* caller must free the returned string */
-
-static char *
-find_suitable_device(void)
+static SANE_Status
+record_read(SANE_Handle h, SANE_Byte *data, SANE_Int max_length,
+	    SANE_Int *length)
 {
-	const SANE_Device **device_list;
-	SANE_Status status;
+	double t0 = stats_clock();
+	SANE_Status status = record_inner->read(h, data, max_length, length);
 
-	char *s = getenv("SANE_DEFAULT_DEVICE");
-	if (s)
-		return strdup(s);
-
-	status = sane_get_devices(&device_list, SANE_FALSE);
-	if (status != SANE_STATUS_GOOD) {
-		printf("sane_get_devices() failed: %s\n",
-		       sane_strstatus(status));
-		return NULL;
-	}
-
-	if (!device_list[0]) {
-		printf("no SANE devices found\n");
-		return NULL;
-	}
+	record_event(RECORD_READ, status, data,
+		     status == SANE_STATUS_GOOD ? *length : 0, t0);
 
-	return strdup(device_list[0]->name);
+	return status;
 }
 
-static TIFF *
-tiff_open(const char *file, const char *icc, int pageno)
+static void
+record_cancel(SANE_Handle h)
 {
-	TIFF *image;
-	char *f;
-	int len;
+	record_inner->cancel(h);
+}
 
-	/* alloc space for file name + formatting */
-	len = strlen(file) * 2;
+static void
+record_close(SANE_Handle h)
+{
+	record_inner->close(h);
+}
 
-	f = malloc(len);
-	if (f == NULL)
-		return NULL;
+static const struct source record_source = {
+	.start = record_start,
+	.get_parameters = record_get_parameters,
+	.read = record_read,
+	.cancel = record_cancel,
+	.close = record_close,
+};
 
-	/* add formatting to the file name */
-	snprintf(f, len, file, pageno);
+/* put the recorder between the scan and its source */
+static int
+record_begin(const char *file, int resolution)
+{
+	struct record_header hdr;
 
-	image = TIFFOpen(f, "w");
+	record_fp = fopen(file, "wb");
+	if (record_fp == NULL) {
+		printf("cannot create %s: %s\n", file, strerror(errno));
+		return -1;
+	}
 
-	free(f);
+	memset(&hdr, 0x00, sizeof(hdr));
+	memcpy(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic));
+	hdr.version = RECORD_VERSION;
+	hdr.resolution = resolution;
 
-	/* embed ICC profile */
-	if (image && icc)
-		embed_icc_profile(image, icc);
+	record_error = fwrite(&hdr, sizeof(hdr), 1, record_fp) != 1;
+	record_inner = source;
+	source = &record_source;
 
-	return image;
+	return 0;
 }
 
-// XXX check allocations
-void tiff2pdf(TIFF *image)
+static int
+record_end(const char *file)
 {
-        TIFFFlush(image);
+	source = record_inner;
 
-	int len = strlen(TIFFFileName(image));
+	if (fclose(record_fp) != 0 || record_error) {
+		printf("cannot write %s\n", file);
+		return -1;
+	}
 
-	char *tif = malloc(len + 1);
-	char *pdf = malloc(len + 4 + 1);
+	if (verbose)
+		printf("recorded to %s\n", file);
 
-	if (tif == NULL || pdf == NULL) {
+	return 0;
+}
 
-		printf("out of memory\n");
+struct replay {
+	const unsigned char *map;
+	size_t size;
+	size_t pos;		/* of the next event */
+	int resolution;
+	SANE_Parameters parm;	/* of the current frame */
+	const struct record_event *ev;	/* being read */
+	uint32_t off;		/* of its data already returned */
+	int cancelled;
+};
 
-		free(tif);
-		free(pdf);
+/* the event at *pos, NULL at the end of the file */
+static const struct record_event *
+replay_event(const struct replay *rp, size_t *pos)
+{
+	const struct record_event *ev;
 
-		return;
-	}
+	if (rp->size - *pos < sizeof(*ev))
+		return NULL;
 
-	strcpy(tif, TIFFFileName(image));
+	ev = (const void *) (rp->map + *pos);
+	if (ev->len > rp->size - *pos - sizeof(*ev))
+		return NULL;
 
-	// truncate the extension if .tif
-	if (tif[len - 1 - 3] == '.') {
-		tif[len - 1 - 3] = '\0';
-	}
+	*pos += sizeof(*ev) + ((ev->len + 7) & ~7);
+	if (*pos > rp->size)
+		*pos = rp->size;
 
-	sprintf(pdf, "%s.pdf", tif);
+	return ev;
+}
 
-	printf("Saving PDF to %s\n", pdf);
+/* the parameters given from *pos up to the next frame, with any set
+ * the first ones given in the file
+ */
+static void
+replay_params(struct replay *rp, size_t pos, int any)
+{
+	const struct record_event *ev;
 
-	char *cmd = malloc(strlen("tiff2pdf")
-			+ strlen(pdf_options)
-			+ strlen(pdf) + len + 10);
+	while ((ev = replay_event(rp, &pos)) != NULL
+	       && (any || ev->type != RECORD_START)) {
+		const struct record_params *p = (const void *) (ev + 1);
 
-	sprintf(cmd, "%s %s -o %s %s", "tiff2pdf", pdf_options, pdf, TIFFFileName(image));
-	if (verbose > 1) {
-		printf("executing %s\n", cmd);
-	}
+		if (ev->type != RECORD_PARAMS
+		    || ev->status != SANE_STATUS_GOOD
+		    || ev->len < sizeof(*p))
+			continue;
 
-	int err = system(cmd);
-	if (err != 0) {
-		printf("error %d while executing %s", err, cmd);
+		rp->parm.format = p->format;
+		rp->parm.last_frame = p->last_frame;
+		rp->parm.bytes_per_line = p->bytes_per_line;
+		rp->parm.pixels_per_line = p->pixels_per_line;
+		rp->parm.lines = p->lines;
+		rp->parm.depth = p->depth;
+		break;
 	}
+}
 
-	free(cmd);
-	free(tif);
-	free(pdf);
+/* take as long as the scanner did, --replay-speed times faster */
+static void
+replay_wait(const struct record_event *ev)
+{
+	struct timespec ts;
+	double s;
+
+	if (replay_speed <= 0)
+		return;
+
+	s = ev->ns / 1e9 / replay_speed;
+	ts.tv_sec = s;
+	ts.tv_nsec = (s - ts.tv_sec) * 1e9;
+
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
 }
 
 static SANE_Status
-scan(SANE_Handle handle)
+replay_start(SANE_Handle h)
 {
-	char readbuf[2];
-	char *readbuf2;
-	char *cwd = get_current_dir_name();
+	struct replay *rp = h;
+	const struct record_event *ev;
 
-	TIFF *image = NULL;
+	rp->ev = NULL;
+	rp->cancelled = 0;
 
-	int n = batch_start_at;
-	int count = batch_amount;
+	/* what was left of the previous frame is skipped */
+	while ((ev = replay_event(rp, &rp->pos)) != NULL
+	       && ev->type != RECORD_START)
+		;
 
-	SANE_Status status = SANE_STATUS_GOOD;
+	if (ev == NULL)
+		return SANE_STATUS_NO_DOCS;
 
-	int resolution = get_resolution(handle);	/* XXX */
+	replay_wait(ev);
+	replay_params(rp, rp->pos, 0);
 
-	signal(SIGHUP, sighandler);
-	signal(SIGINT, sighandler);
-	signal(SIGPIPE, sighandler);
-	signal(SIGTERM, sighandler);
+	return ev->status;
+}
 
-	if (output_file == NULL) {
-		/* choice an appropriate file name */
-		time_t now = time(NULL);
+static SANE_Status
+replay_get_parameters(SANE_Handle h, SANE_Parameters *parm)
+{
+	struct replay *rp = h;
 
-		strftime((char *) output_file_buf, 16,
-			 "%Y%m%d%H%M%S", localtime(&now));
+	*parm = rp->parm;
 
-		if (batch && !multi)
-			strcat((char *) output_file_buf, "-%04d");
+	return SANE_STATUS_GOOD;
+}
 
-		strcat((char *) output_file_buf, ".tif");
+static SANE_Status
+replay_read(SANE_Handle h, SANE_Byte *data, SANE_Int max_length,
+	    SANE_Int *length)
+{
+	struct replay *rp = h;
+	uint32_t len;
 
-		output_file = output_file_buf;
-	}
+	*length = 0;
 
-	printf("Scanning to %s at %d dpi\n", output_file, resolution);
+	if (rp->cancelled)
+		return SANE_STATUS_CANCELLED;
 
-	if (resolution < 100)
-		printf("WARNING: you are scanning at a low dpi value, please check your parameters\n");
+	while (rp->ev == NULL) {
+		size_t pos = rp->pos;
+		const struct record_event *ev = replay_event(rp, &pos);
 
-	if (batch) {
+		/* the frame ends where the next one starts */
+		if (ev == NULL || ev->type == RECORD_START)
+			return SANE_STATUS_EOF;
 
-		if (batch_amount != BATCH_COUNT_UNLIMITED)
-			printf(" %d", batch_amount);
-		else
-			printf(" an unknown amount of");
+		rp->pos = pos;
+		if (ev->type != RECORD_READ)
+			continue;
 
-		printf(" pages, incrementing by %d, numbering from %d\n",
-		       batch_increment, batch_start_at);
+		replay_wait(ev);
+		if (ev->status != SANE_STATUS_GOOD)
+			return ev->status;
+
+		rp->ev = ev;
+		rp->off = 0;
 	}
 
-	do {
-		/* open file if necessary */
-		if (image == NULL)
-			image = tiff_open(output_file, icc_profile, n);
+	/* a smaller --read-buffer gets the chunk in pieces */
+	len = rp->ev->len - rp->off;
+	if (len > (uint32_t) max_length)
+		len = max_length;
 
-		if (image == NULL) {
-			printf("cannot open file\n");
-			break;
-		}
+	memcpy(data, (const unsigned char *) (rp->ev + 1) + rp->off, len);
+	*length = len;
 
-		/* XXX check return code */
+	rp->off += len;
+	if (rp->off == rp->ev->len)
+		rp->ev = NULL;
 
-		if (batch_prompt) {
-			printf("Place page no. %d on the scanner.\n", n);
-			printf("Press <RETURN> to continue.\n");
-			printf("Press Ctrl + D to terminate.\n");
-			readbuf2 = fgets(readbuf, 2, stdin);
+	return SANE_STATUS_GOOD;
+}
 
-			if (readbuf2 == NULL) {
-				printf("Batch terminated, %d pages scanned\n",
-				       (n - batch_increment));
-				break;	/* get out of this loop */
-			}
-		}
+static void
+replay_cancel(SANE_Handle h)
+{
+	struct replay *rp = h;
 
-		if (batch) {
-			printf("Scanning page %d... ", n);
-			fflush(stdout);
-		}
+	rp->cancelled = 1;
+	rp->ev = NULL;
+}
 
-		status = scan_to_tiff(image, n,
-				      (batch_amount > 0) ? batch_amount : 0,
-				      resolution);
+static void
+replay_close(SANE_Handle h)
+{
+	struct replay *rp = h;
 
-		/* no more docs, stop here */
-		if (status == SANE_STATUS_NO_DOCS) {
-			printf("No (more) documents in the scanner\n");
-			break;
-		}
+	munmap((void *) rp->map, rp->size);
+	free(rp);
+}
 
-		if (batch) {
+static const struct source replay_source = {
+	.start = replay_start,
+	.get_parameters = replay_get_parameters,
+	.read = replay_read,
+	.cancel = replay_cancel,
+	.close = replay_close,
+};
 
-			printf("to %s .\n", TIFFFileName(image));
+static SANE_Handle
+replay_open(const char *file)
+{
+	const struct record_header *hdr;
+	struct replay *rp;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		printf("cannot open %s: %s\n", file, strerror(errno));
+		return NULL;
+	}
 
-		} else if (verbose > 1) {
-			printf("Scanned page %d to %s .\n",
-			       n, TIFFFileName(image));
-		}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(*hdr)) {
+		printf("%s is not a tiffscan recording\n", file);
+		close(fd);
+		return NULL;
+	}
 
-		/* continue reading when EOF */
-		if (status == SANE_STATUS_EOF)
-			status = SANE_STATUS_GOOD;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("cannot map %s: %s\n", file, strerror(errno));
+		return NULL;
+	}
 
-		/* any error? */
-		if (status != SANE_STATUS_GOOD)
-			break;
+	hdr = map;
+	if (memcmp(hdr->magic, RECORD_MAGIC, sizeof(hdr->magic)) != 0
+	    || hdr->version != RECORD_VERSION) {
+		printf("%s is not a tiffscan recording\n", file);
+		munmap(map, st.st_size);
+		return NULL;
+	}
 
-		/* continuing... */
+	rp = calloc(1, sizeof(*rp));
+	if (rp == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
 
-		/* write current image and prepare for next one */
-		TIFFWriteDirectory(image);
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
 
-		/* close if appropriate */
-		if (batch && !multi) {
+	rp->map = map;
+	rp->size = st.st_size;
+	rp->pos = sizeof(*hdr);
+	rp->resolution = hdr->resolution;
 
-			if (pdf_mode) {
-				tiff2pdf(image);
+	/* for those asked before the first frame, the first frame's when
+	 * none were recorded before it
+	 */
+	replay_params(rp, rp->pos, 1);
+
+	return rp;
+}
+
+/* XXX stats.c */
+
+/* Per page timings and sizes, printed with --stats and written as one
+ * JSON object per line with --stats-json. Tells whether the scanner,
+ * the CPU or the disk is what keeps a batch slow.
+ */
+
+#define STATS_BUCKETS 32
+
+struct stats {
+	int pageno;
+	double start;		/* sane_start() called */
+	double first_byte;	/* first data out of sane_read() */
+	double end;		/* page received and encoded */
+	double read_time;	/* inside sane_read() */
+	double wait_time;	/* encoder waiting for the reader */
+	double blocked_time;	/* reader waiting for the encoder */
+	long encoder_waits;
+	long reader_waits;
+	double encode_time;	/* encoder busy with the data */
+	double finish_time;	/* directory, close and PDF, in the background */
+	long reads;
+	long read_hist[STATS_BUCKETS];	/* by power of two of the length */
+	size_t read_buffer_max;	/* largest size asked of sane_read() */
+	uint64_t rows;
+	uint64_t raw_bytes;
+	uint64_t file_bytes;	/* what the page added to the file */
+	uint64_t ink;		/* dark samples, with --skip-blank */
+	uint64_t samples;
+	double spool_time;	/* --deskew and --autocrop stages */
+	double detect_time;
+	double transform_time;
+	double skew;		/* degrees */
+};
+
+static FILE *stats_fp;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;	/* stats_fp */
+
+static double
+stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* account for a sane_read() call that went from t0 to t1 */
+static void
+stats_read(struct stats *st, double t0, double t1, SANE_Int len)
+{
+	int bucket = 0;
+
+	st->reads++;
+	st->read_time += t1 - t0;
+
+	if (len <= 0)
+		return;
+
+	if (st->first_byte == 0)
+		st->first_byte = t1;
+
+	while (bucket < STATS_BUCKETS - 1 && (len >> (bucket + 1)))
+		bucket++;
+
+	st->read_hist[bucket]++;
+}
+
+static const char *
+stats_size(char *buf, size_t size, uint64_t bytes)
+{
+	if (bytes >= 1024 * 1024)
+		snprintf(buf, size, "%lu Mb", (unsigned long) (bytes >> 20));
+	else if (bytes >= 1024)
+		snprintf(buf, size, "%lu Kb", (unsigned long) (bytes >> 10));
+	else
+		snprintf(buf, size, "%lu b", (unsigned long) bytes);
+
+	return buf;
+}
+
+static void
+stats_open(void)
+{
+	if (stats_json == NULL)
+		return;
+
+	if (strcmp(stats_json, "-") == 0)
+		stats_fp = stdout;
+	else
+		stats_fp = fopen(stats_json, "w");
+
+	if (stats_fp == NULL)
+		printf("cannot open %s: %s\n", stats_json, strerror(errno));
+}
+
+/* "key": "value", with the value escaped, it comes from --device */
+static void
+stats_json_string(FILE *fp, const char *key, const char *value)
+{
+	const unsigned char *p;
+
+	fprintf(fp, "\"%s\": \"", key);
+
+	for (p = (const unsigned char *) value; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(fp, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(fp, "\\u%04x", *p);
+		else
+			fputc(*p, fp);
+	}
+
+	fprintf(fp, "\", ");
+}
+
+/* the page goes into the totals of its batch */
+static void
+stats_add(struct stats *total, const struct stats *st)
+{
+	total->reads += st->reads;
+	total->read_time += st->read_time;
+	total->wait_time += st->wait_time;
+	total->blocked_time += st->blocked_time;
+	total->encoder_waits += st->encoder_waits;
+	total->reader_waits += st->reader_waits;
+	total->encode_time += st->encode_time;
+	total->finish_time += st->finish_time;
+	total->rows += st->rows;
+	total->raw_bytes += st->raw_bytes;
+	total->file_bytes += st->file_bytes;
+}
+
+/* called, in order, once the page is finished. device names the
+ * scanner when there are several.
+ */
+static void
+stats_page(const char *device, const struct stats *st)
+{
+	double scan_time = st->end - st->start;
+	double ttfb = st->first_byte ? st->first_byte - st->start : 0;
+	int i;
+
+	if (show_stats) {
+		char *text = NULL, a[32], b[32];
+		size_t len;
+		FILE *fp = open_memstream(&text, &len);
+
+		if (fp == NULL)
+			return;
+
+		/* one printf, as the scan of the next page goes on */
+		fprintf(fp, "%s%spage %d: scanned in %.2f s, first byte after "
+			"%.2f s, finished in %.2f s\n", device ? device : "",
+			device ? " " : "", st->pageno, scan_time, ttfb,
+			st->finish_time);
+		fprintf(fp, "  %ld reads taking %.2f s, encoder waited "
+			"%ld times for %.2f s and worked %.2f s, reader "
+			"waited %ld times for %.2f s\n", st->reads,
+			st->read_time, st->encoder_waits, st->wait_time,
+			st->encode_time, st->reader_waits, st->blocked_time);
+		fprintf(fp, "  read buffer up to %s, read sizes:",
+			stats_size(a, sizeof(a), st->read_buffer_max));
+		for (i = 0; i < STATS_BUCKETS; i++) {
+			if (st->read_hist[i])
+				fprintf(fp, " %s+: %ld",
+					stats_size(a, sizeof(a), 1ULL << i),
+					st->read_hist[i]);
+		}
+		fprintf(fp, "\n  %s raw, %s written (%.1f%%)\n",
+			stats_size(a, sizeof(a), st->raw_bytes),
+			stats_size(b, sizeof(b), st->file_bytes),
+			st->raw_bytes ?
+			100.0 * st->file_bytes / st->raw_bytes : 0);
+		if (deskew || autocrop)
+			fprintf(fp, "  skew %.2f degrees, spooled in %.2f s, "
+				"analysed in %.2f s, rotated and cropped in "
+				"%.2f s\n", st->skew, st->spool_time,
+				st->detect_time, st->transform_time);
+		fclose(fp);
+
+		fputs(text, stdout);
+		free(text);
+	}
+
+	if (stats_fp) {
+		int first = 1;
+
+		pthread_mutex_lock(&stats_lock);
+		fprintf(stats_fp, "{");
+		if (device)
+			stats_json_string(stats_fp, "device", device);
+		fprintf(stats_fp, "\"page\": %d, \"scan_time\": %.3f, "
+			"\"ttfb\": %.3f, \"reads\": %ld, \"read_buffer\": %lu, "
+			"\"read_histogram\": {", st->pageno, scan_time, ttfb,
+			st->reads, (unsigned long) st->read_buffer_max);
+		for (i = 0; i < STATS_BUCKETS; i++) {
+			if (st->read_hist[i]) {
+				fprintf(stats_fp, "%s\"%llu\": %ld",
+					first ? "" : ", ", 1ULL << i,
+					st->read_hist[i]);
+				first = 0;
+			}
+		}
+		fprintf(stats_fp, "}, \"read_time\": %.3f, "
+			"\"wait_time\": %.3f, \"encoder_waits\": %ld, "
+			"\"blocked_time\": %.3f, \"reader_waits\": %ld, "
+			"\"encode_time\": %.3f, "
+			"\"finish_time\": %.3f, \"raw_bytes\": %llu, "
+			"\"file_bytes\": %llu", st->read_time,
+			st->wait_time, st->encoder_waits, st->blocked_time,
+			st->reader_waits, st->encode_time, st->finish_time,
+			(unsigned long long) st->raw_bytes,
+			(unsigned long long) st->file_bytes);
+		if (deskew || autocrop)
+			fprintf(stats_fp, ", \"skew\": %.3f, "
+				"\"spool_time\": %.3f, \"detect_time\": "
+				"%.3f, \"transform_time\": %.3f", st->skew,
+				st->spool_time, st->detect_time,
+				st->transform_time);
+		fprintf(stats_fp, "}\n");
+		fflush(stats_fp);
+		pthread_mutex_unlock(&stats_lock);
+	}
+}
+
+/* the whole batch of a device, elapsed seconds from its first
+ * sane_start()
+ */
+static void
+stats_close(const char *device, const struct stats *total, int pages,
+	    double elapsed)
+{
+	double ppm = elapsed > 0 ? pages * 60.0 / elapsed : 0;
+
+	if (show_stats && pages) {
+		char a[32], b[32];
+
+		printf("%s%s%d pages in %.2f s, %.1f pages/min, %s raw, "
+		       "%s written\n", device ? device : "",
+		       device ? ": " : "", pages, elapsed, ppm,
+		       stats_size(a, sizeof(a), total->raw_bytes),
+		       stats_size(b, sizeof(b), total->file_bytes));
+	}
+
+	/* one line for make bench */
+	if ((source == &synthetic_source || source == &replay_source)
+	    && elapsed > 0) {
+		printf("%s %s: %.1f MB/s, %.0f rows/s, ratio %.2f:1\n",
+		       source == &replay_source ? "replay" : "synthetic",
+		       source == &replay_source ? replay_file : synthetic,
+		       total->raw_bytes / elapsed / 1e6,
+		       total->rows / elapsed,
+		       total->file_bytes ? (double)
+		       total->raw_bytes / total->file_bytes : 0);
+	}
+
+	if (stats_fp) {
+		pthread_mutex_lock(&stats_lock);
+		fprintf(stats_fp, "{");
+		if (device)
+			stats_json_string(stats_fp, "device", device);
+		fprintf(stats_fp, "\"pages\": %d, \"elapsed\": %.3f, "
+			"\"pages_per_minute\": %.2f, \"reads\": %ld, "
+			"\"read_time\": %.3f, \"wait_time\": %.3f, "
+			"\"encoder_waits\": %ld, \"blocked_time\": %.3f, "
+			"\"reader_waits\": %ld, "
+			"\"encode_time\": %.3f, \"finish_time\": %.3f, "
+			"\"raw_bytes\": %llu, \"file_bytes\": %llu}\n",
+			pages, elapsed, ppm, total->reads,
+			total->read_time, total->wait_time,
+			total->encoder_waits, total->blocked_time,
+			total->reader_waits,
+			total->encode_time, total->finish_time,
+			(unsigned long long) total->raw_bytes,
+			(unsigned long long) total->file_bytes);
+		fflush(stats_fp);
+		pthread_mutex_unlock(&stats_lock);
+	}
+}
+
+static void
+stats_done(void)
+{
+	if (stats_fp && stats_fp != stdout)
+		fclose(stats_fp);
+	stats_fp = NULL;
+}
+
+/* XXX journal.c */
+
+/* A batch keeps a journal next to its first file, FILE.journal, with a
+ * line for each page on disk: its number and, for multi-page files, the
+ * offset of its directory and the file size once it was written. Every
+ * JOURNAL_SYNC_PAGES pages the TIFF file is synced, then the lines that
+ * describe it. The journal is removed when the batch ends well. With
+ * --resume a multi-page file is cut back to the last page in the journal
+ * and the batch goes on from the next page number.
+ */
+
+#define JOURNAL_SYNC_PAGES	8
+#define JOURNAL_MAGIC		"tiffscan journal 1"
+
+struct journal {
+	FILE *fp;
+	char *path;
+	char *pending;		/* lines waiting for the next sync */
+	int unsynced;
+	int pages;		/* in the journal */
+	int last_page;		/* number of the last one */
+	uint64_t last_ifd;	/* multi-page, directory of the last page */
+	uint64_t size;		/* multi-page, file size after it */
+};
+
+static uint64_t
+journal_get(const unsigned char *b, int n, int be)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		v = v << 8 | b[be ? i : n - 1 - i];
+
+	return v;
+}
+
+/* where the offset of the directory after ifd is stored, 0 is the header */
+static int
+journal_link(int fd, uint64_t ifd, off_t *pos, int *width, int *be)
+{
+	unsigned char b[8];
+	uint64_t count;
+	int big;
+
+	if (pread(fd, b, 4, 0) != 4)
+		return -1;
+
+	*be = b[0] == 'M';
+	big = journal_get(b + 2, 2, *be) == 43;
+	*width = big ? 8 : 4;
+
+	if (ifd == 0) {
+		*pos = big ? 8 : 4;
+		return 0;
+	}
+
+	if (pread(fd, b, big ? 8 : 2, ifd) != (big ? 8 : 2))
+		return -1;
+
+	count = journal_get(b, big ? 8 : 2, *be);
+	*pos = ifd + (big ? 8 + 20 * count : 2 + 12 * count);
+
+	return 0;
+}
+
+static uint64_t
+journal_next(int fd, uint64_t ifd)
+{
+	unsigned char b[8];
+	off_t pos;
+	int width, be;
+
+	if (journal_link(fd, ifd, &pos, &width, &be) != 0
+	    || pread(fd, b, width, pos) != width)
+		return 0;
+
+	return journal_get(b, width, be);
+}
+
+/* what a resumed batch must agree on */
+static void
+journal_options(char *buf, size_t size, int resolution, int bigtiff)
+{
+	snprintf(buf, size, "multi %d bigtiff %d resolution %d start %d "
+		 "increment %d", multi, bigtiff, resolution, batch_start_at,
+		 batch_increment);
+}
+
+/* the TIFF file is synced before the lines that describe it */
+static int
+journal_sync(struct journal *j, int fd)
+{
+	int err = 0;
+
+	if (fd >= 0 && fdatasync(fd) != 0)
+		err = -1;
+
+	if (j->pending) {
+		if (!err && fputs(j->pending, j->fp) < 0)
+			err = -1;
+		free(j->pending);
+		j->pending = NULL;
+	}
+
+	if (fflush(j->fp) != 0 || fdatasync(fileno(j->fp)) != 0)
+		err = -1;
+
+	j->unsynced = 0;
+
+	return err;
+}
+
+/* file is the first file of the batch. a resumed multi-page file is
+ * fixed up here.
+ */
+static int
+journal_start(struct journal *j, const char *file, int resolution,
+	      int bigtiff)
+{
+	char opts[128], *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *fp;
+	int fd;
+
+	memset(j, 0x00, sizeof(*j));
+	j->path = strdup(file);
+	strext(&j->path, ".journal");
+	if (j->path == NULL)
+		return -1;
+
+	journal_options(opts, sizeof(opts), resolution, bigtiff);
+
+	if (!resume) {
+		j->fp = fopen(j->path, "w");
+		if (j->fp == NULL) {
+			printf("cannot create %s: %s\n", j->path,
+			       strerror(errno));
+			goto fail;
+		}
+
+		fprintf(j->fp, "%s\n%s\n", JOURNAL_MAGIC, opts);
+		fflush(j->fp);
+		return 0;
+	}
+
+	fp = fopen(j->path, "r");
+	if (fp == NULL) {
+		printf("nothing to resume, %s: %s\n", j->path, strerror(errno));
+		goto fail;
+	}
+
+	if (getline(&line, &size, fp) <= 0
+	    || strcmp(line, JOURNAL_MAGIC "\n") != 0) {
+		printf("%s is not a tiffscan journal\n", j->path);
+		goto fail_read;
+	}
+
+	if (getline(&line, &size, fp) <= 0
+	    || strncmp(line, opts, strlen(opts)) != 0
+	    || line[strlen(opts)] != '\n') {
+		printf("the batch was started with other options: %s",
+		       line ? line : "\n");
+		goto fail_read;
+	}
+
+	/* a line cut short by the crash is not a page */
+	while ((len = getline(&line, &size, fp)) > 0) {
+		unsigned long long ifd, fsize;
+		int pageno;
+
+		if (line[len - 1] != '\n' || sscanf(line, "page %d %llu %llu",
+						    &pageno, &ifd, &fsize) != 3)
+			break;
+
+		j->pages++;
+		j->last_page = pageno;
+		j->last_ifd = ifd;
+		j->size = fsize;
+	}
+
+	free(line);
+	fclose(fp);
+	line = NULL;
+
+	/* the directory of a page being written, if any, and its data go */
+	if (multi && j->pages) {
+		unsigned char zero[8];
+		off_t pos;
+		int width, be;
+
+		memset(zero, 0x00, sizeof(zero));
+
+		fd = open(file, O_RDWR);
+		if (fd < 0 || ftruncate(fd, j->size) != 0
+		    || journal_link(fd, j->last_ifd, &pos, &width, &be) != 0
+		    || pwrite(fd, zero, width, pos) != width
+		    || fsync(fd) != 0) {
+			printf("cannot resume %s: %s\n", file, strerror(errno));
+			if (fd >= 0)
+				close(fd);
+			goto fail;
+		}
+
+		close(fd);
+	}
+
+	j->fp = fopen(j->path, "a");
+	if (j->fp == NULL) {
+		printf("cannot open %s: %s\n", j->path, strerror(errno));
+		goto fail;
+	}
+
+	return 0;
+
+fail_read:
+	free(line);
+	fclose(fp);
+fail:
+	free(j->path);
+	j->path = NULL;
+	return -1;
+}
+
+/* called by the page worker once the page is in the file. fd is the one
+ * of a multi-page file, -1 for a file of its own, already closed.
+ */
+static void
+journal_page(struct journal *j, int fd, int pageno)
+{
+	char buf[80];
+
+	if (j->fp == NULL)
+		return;
+
+	if (fd >= 0) {
+		struct stat sb;
+		uint64_t ifd = journal_next(fd, j->last_ifd);
+
+		if (ifd == 0 || fstat(fd, &sb) != 0) {
+			printf("cannot follow %s, no more pages journaled\n",
+			       j->path);
+			fclose(j->fp);
+			j->fp = NULL;
+			return;
+		}
+
+		j->last_ifd = ifd;
+		j->size = sb.st_size;
+	}
+
+	snprintf(buf, sizeof(buf), "page %d %llu %llu\n", pageno,
+		 (unsigned long long) j->last_ifd,
+		 (unsigned long long) j->size);
+	strext(&j->pending, buf);
+
+	j->pages++;
+	j->last_page = pageno;
+
+	if (++j->unsynced >= JOURNAL_SYNC_PAGES && journal_sync(j, fd) != 0) {
+		printf("cannot write %s: %s\n", j->path, strerror(errno));
+		fclose(j->fp);
+		j->fp = NULL;
+	}
+}
+
+/* a batch that ended well has nothing to resume */
+static void
+journal_end(struct journal *j, int done)
+{
+	if (j->fp) {
+		journal_sync(j, -1);
+		fclose(j->fp);
+	}
+
+	if (j->path && done)
+		unlink(j->path);
+
+	free(j->pending);
+	free(j->path);
+	memset(j, 0x00, sizeof(*j));
+}
+
+/* XXX device.c */
+
+/* --device can be given more than once, each scanner is then driven by
+ * a thread of its own running scan(). They share the compression threads
+ * and the worker finishing the pages; the file names, page numbers and
+ * statistics are their own. Backend options given after a --device, and
+ * --output-file, apply to that device only.
+ */
+
+struct device {
+	char *name;
+	SANE_Handle handle;
+	int resolution_optind;
+	int corners[4];
+	struct poptOption *options;	/* of the backend, enumerated once */
+	char *options_desc;
+	const char *output_file;	/* --output-file of this device */
+	int stream_fd;			/* --stream, while scanning */
+	int batch_count;
+	SANE_Status status;		/* of scan() */
+	pthread_t thread;
+
+	/* page.c, under page_lock */
+	int page_busy;			/* jobs on a file still in use */
+	int page_queued;		/* jobs not finished yet */
+	SANE_Status page_status;	/* first error of a finished page */
+	off_t page_offset;		/* where the page began, worker only */
+
+	/* the batch so far, worker only */
+	struct stats stats_total;
+	int stats_pages;
+	struct journal journal;
+};
+
+/* name is taken over */
+static int
+device_add(char *name)
+{
+	struct device *d;
+
+	d = realloc(devices, (ndevices + 1) * sizeof(*d));
+	if (d == NULL) {
+		printf("out of memory\n");
+		free(name);
+		return -1;
+	}
+
+	devices = d;
+	d = &devices[ndevices++];
+
+	memset(d, 0x00, sizeof(*d));
+	d->name = name;
+	d->resolution_optind = -1;
+	memset(d->corners, -1, sizeof(d->corners));
+
+	return 0;
+}
+
+static void
+devices_cancel(void)
+{
+	int i;
+
+	for (i = 0; i < ndevices; i++) {
+		if (devices[i].handle)
+			source->cancel(devices[i].handle);
+	}
+}
+
+static void
+devices_free(void)
+{
+	int i;
+
+	for (i = 0; i < ndevices; i++) {
+		struct device *d = &devices[i];
+
+		if (d->handle) {
+			if (verbose > 1)
+				printf("closing device %s\n", d->name);
+			source->close(d->handle);
+		}
+
+		free(d->options);
+		free(d->options_desc);
+		free(d->name);
+	}
+
+	free(devices);
+	devices = NULL;
+	ndevices = 0;
+}
+
+/* what is printed before the messages of a device, when there are several */
+static const char *
+device_tag(const struct device *dev)
+{
+	return ndevices > 1 ? dev->name : NULL;
+}
+
+/* the file name template of the device, devices that would write to the
+ * same files get their number added before the extension
+ */
+static char *
+device_output_file(const struct device *dev)
+{
+	const char *file = dev->output_file, *ext;
+	char *name = NULL, buf[32];
+	int i, shared = 0;
+
+	for (i = 0; i < ndevices; i++) {
+		const char *o = devices[i].output_file;
+
+		if (&devices[i] != dev && (o == file || (o && file
+						    && strcmp(o, file) == 0)))
+			shared = 1;
+	}
+
+	if (file == NULL) {
+		/* choice an appropriate file name */
+		time_t now = time(NULL);
+		struct tm tm;
+
+		strftime(buf, sizeof(buf), "%Y%m%d%H%M%S",
+			 localtime_r(&now, &tm));
+		strext(&name, buf);
+		ext = batch && !multi ? "-%04d.tif" : ".tif";
+	} else {
+		ext = strrchr(file, '.');
+		if (ext == NULL || strchr(ext, '/') || !shared)
+			ext = file + strlen(file);
+
+		name = strndup(file, ext - file);
+	}
+
+	if (name && shared) {
+		snprintf(buf, sizeof(buf), "-%d", (int) (dev - devices) + 1);
+		strext(&name, buf);
+	}
+
+	if (name)
+		strext(&name, ext);
+
+	return name;
+}
+
+/* XXX cache.c */
+
+/* sane_get_devices() can take seconds on network backends, and the
+ * backend option table costs a descriptor and a GET_VALUE per option.
+ * Both are kept under $XDG_CACHE_HOME/tiffscan for --cache-ttl seconds,
+ * keyed by the device name and the version sane_init() returned. A
+ * cached option table is all --help needs, the device is not opened.
+ */
+
+static SANE_Int cache_version;
+
+/* the cache directory, or the file of name in it */
+static char *
+cache_path(const char *name)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	char *path = NULL, *p;
+	size_t len;
+
+	if (cache_ttl <= 0)
+		return NULL;
+
+	if (base && *base)
+		strext(&path, base);
+	else {
+		base = getenv("HOME");
+		if (base == NULL || *base == '\0')
+			return NULL;
+
+		strext(&path, base);
+		strext(&path, "/.cache");
+	}
+
+	strext(&path, "/tiffscan");
+
+	if (name == NULL)
+		return path;
+
+	strext(&path, "/");
+	len = strlen(path);
+	strext(&path, name);
+
+	/* device names hold ':' and '/' */
+	for (p = path + len; *p; p++) {
+		if (!isalnum((unsigned char) *p) && *p != '-' && *p != '.')
+			*p = '_';
+	}
+
+	return path;
+}
+
+/* NULL if missing, expired or --refresh was given */
+static FILE *
+cache_open(const char *name)
+{
+	char *path;
+	struct stat sb;
+	FILE *fp = NULL;
+	time_t now = time(NULL);
+
+	if (cache_refresh)
+		return NULL;
+
+	path = cache_path(name);
+	if (path == NULL)
+		return NULL;
+
+	if (stat(path, &sb) == 0 && sb.st_mtime <= now
+	    && now - sb.st_mtime < cache_ttl)
+		fp = fopen(path, "r");
+
+	free(path);
+
+	return fp;
+}
+
+/* written to a temporary file, renamed over the old one by cache_commit() */
+static FILE *
+cache_create(char **tmp)
+{
+	char *dir, *p;
+	FILE *fp;
+	int fd;
+
+	dir = cache_path(NULL);
+	if (dir == NULL)
+		return NULL;
+
+	for (p = strchr(dir + 1, '/'); ; p = strchr(p + 1, '/')) {
+		if (p)
+			*p = '\0';
+		mkdir(dir, 0700);
+		if (p == NULL)
+			break;
+		*p = '/';
+	}
+
+	*tmp = dir;
+	strext(tmp, "/.tmp-XXXXXX");
+
+	fd = mkstemp(*tmp);
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(*tmp);
+		}
+		free(*tmp);
+		return NULL;
+	}
+
+	return fp;
+}
+
+static void
+cache_commit(FILE *fp, char *tmp, const char *name)
+{
+	char *path = cache_path(name);
+	int err = ferror(fp);
+
+	if (fclose(fp) != 0 || err || path == NULL
+	    || rename(tmp, path) != 0)
+		unlink(tmp);
+
+	free(path);
+	free(tmp);
+}
+
+static void
+cache_put(FILE *fp, const char *str)
+{
+	for (; str && *str; str++) {
+		if (*str == '\\')
+			fputs("\\\\", fp);
+		else if (*str == '\t')
+			fputs("\\t", fp);
+		else if (*str == '\n')
+			fputs("\\n", fp);
+		else
+			fputc(*str, fp);
+	}
+}
+
+/* the next tab separated field of *line, unescaped in place */
+static char *
+cache_field(char **line)
+{
+	char *r, *w, c;
+
+	if (*line == NULL)
+		return NULL;
+
+	for (r = w = *line; *r && *r != '\t' && *r != '\n'; r++) {
+		if (*r == '\\' && r[1]) {
+			r++;
+			*w++ = *r == 't' ? '\t' : *r == 'n' ? '\n' : *r;
+		} else
+			*w++ = *r;
+	}
+
+	c = *r;
+	*w = '\0';
+
+	w = *line;
+	*line = c == '\t' ? r + 1 : NULL;
+
+	return w;
+}
+
+static int
+cache_load_devices(const SANE_Device ***list)
+{
+	static SANE_Device *cached;
+	static const SANE_Device **cached_list;
+	char *line = NULL, *p;
+	size_t size = 0;
+	int n = 0, ok = 0;
+	FILE *fp;
+
+	if (cached_list) {
+		*list = cached_list;
+		return 0;
+	}
+
+	fp = cache_open("devices");
+	if (fp == NULL)
+		return -1;
+
+	if (getline(&line, &size, fp) > 0 && atoi(line) == cache_version) {
+		ok = 1;
+
+		while (ok && getline(&line, &size, fp) > 0) {
+			SANE_Device *d;
+
+			d = realloc(cached, (n + 1) * sizeof(*d));
+			if (d == NULL) {
+				ok = 0;
+				break;
+			}
+			cached = d;
+			d = &cached[n];
+
+			p = line;
+			d->name = strdup(cache_field(&p));
+			d->vendor = strdup(p ? cache_field(&p) : "");
+			d->model = strdup(p ? cache_field(&p) : "");
+			d->type = strdup(p ? cache_field(&p) : "");
+			n++;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	/* nothing found is not remembered, see cache_get_devices() */
+	if (!ok || n == 0)
+		return -1;
+
+	cached_list = calloc(n + 1, sizeof(*cached_list));
+	if (cached_list == NULL)
+		return -1;
+
+	while (n--)
+		cached_list[n] = &cached[n];
+
+	*list = cached_list;
+
+	return 0;
+}
+
+/* sane_get_devices(), the local and network ones, through the cache */
+static SANE_Status
+cache_get_devices(const SANE_Device ***list)
+{
+	SANE_Status status;
+	char *tmp;
+	FILE *fp;
+	int i;
+
+	if (cache_load_devices(list) == 0)
+		return SANE_STATUS_GOOD;
+
+	status = sane_get_devices(list, SANE_FALSE);
+	if (status != SANE_STATUS_GOOD)
+		return status;
+
+	/* a scanner plugged in later must be looked for again */
+	if ((*list)[0] == NULL || (fp = cache_create(&tmp)) == NULL)
+		return status;
+
+	fprintf(fp, "%d\n", cache_version);
+
+	for (i = 0; (*list)[i]; i++) {
+		const SANE_Device *d = (*list)[i];
+
+		cache_put(fp, d->name);
+		fputc('\t', fp);
+		cache_put(fp, d->vendor);
+		fputc('\t', fp);
+		cache_put(fp, d->model);
+		fputc('\t', fp);
+		cache_put(fp, d->type);
+		fputc('\n', fp);
+	}
+
+	cache_commit(fp, tmp, "devices");
+
+	return status;
+}
+
+/* the option table of the device as fetch_options() built it. with the
+ * device open, a different number of options means a different backend.
+ */
+static int
+cache_load_options(struct device *dev)
+{
+	struct poptOption *options = NULL;
+	char *line = NULL, *p;
+	size_t size = 0;
+	SANE_Int count = 0;
+	int i, n = 0, ok = 0;
+	FILE *fp;
+
+	fp = cache_open(dev->name);
+	if (fp == NULL)
+		return -1;
+
+	if (dev->handle && sane_control_option(dev->handle, 0,
+					       SANE_ACTION_GET_VALUE, &count,
+					       0) != SANE_STATUS_GOOD)
+		count = -1;
+
+	/* version, name and number of options */
+	if (getline(&line, &size, fp) > 0) {
+		p = line;
+		ok = atoi(cache_field(&p)) == cache_version && p
+		    && strcmp(cache_field(&p), dev->name) == 0 && p
+		    && (dev->handle == NULL || atoi(cache_field(&p)) == count);
+	}
+
+	/* resolution and corners */
+	if (ok && getline(&line, &size, fp) > 0) {
+		p = line;
+		dev->resolution_optind = atoi(cache_field(&p));
+		for (i = 0; i < 4; i++)
+			dev->corners[i] = p ? atoi(cache_field(&p)) : -1;
+	} else
+		ok = 0;
+
+	while (ok && getline(&line, &size, fp) > 0) {
+		struct poptOption *o;
+		const char *arg;
+
+		o = realloc(options, (n + 2) * sizeof(*o));
+		if (o == NULL) {
+			ok = 0;
+			break;
+		}
+		options = o;
+		o = &options[n++];
+
+		memset(o, 0x00, 2 * sizeof(*o));
+
+		p = line;
+		o->val = atoi(cache_field(&p));
+		o->argInfo = p ? strtoul(cache_field(&p), NULL, 10) : 0;
+		o->longName = strdup(p ? cache_field(&p) : "unknown");
+		o->descrip = strdup(p ? cache_field(&p) : " ");
+		arg = p ? cache_field(&p) : "";
+		o->argDescrip = *arg ? strdup(arg) : NULL;
+	}
+
+	free(line);
+	fclose(fp);
+
+	if (!ok || options == NULL) {
+		free(options);
+		dev->resolution_optind = -1;
+		memset(dev->corners, -1, sizeof(dev->corners));
+		return -1;
+	}
+
+	if (verbose > 1)
+		printf("options of %s from the cache\n", dev->name);
+
+	dev->options = options;
+
+	return 0;
+}
+
+static void
+cache_save_options(const struct device *dev)
+{
+	const struct poptOption *o;
+	SANE_Int count;
+	char *tmp;
+	FILE *fp;
+
+	if (sane_control_option(dev->handle, 0, SANE_ACTION_GET_VALUE,
+				&count, 0) != SANE_STATUS_GOOD)
+		return;
+
+	fp = cache_create(&tmp);
+	if (fp == NULL)
+		return;
+
+	fprintf(fp, "%d\t", cache_version);
+	cache_put(fp, dev->name);
+	fprintf(fp, "\t%d\n%d\t%d\t%d\t%d\t%d\n", count,
+		dev->resolution_optind, dev->corners[0], dev->corners[1],
+		dev->corners[2], dev->corners[3]);
+
+	for (o = dev->options; o->longName; o++) {
+		fprintf(fp, "%d\t%u\t", o->val, o->argInfo);
+		cache_put(fp, o->longName);
+		fputc('\t', fp);
+		cache_put(fp, o->descrip);
+		fputc('\t', fp);
+		cache_put(fp, o->argDescrip);
+		fputc('\n', fp);
+	}
+
+	cache_commit(fp, tmp, dev->name);
+}
+
+/* the backend option table of the device, from the cache if possible */
+static int
+device_options(struct device *dev)
+{
+	if (dev->options)
+		return 0;
+
+	if (cache_load_options(dev) == 0)
+		return 0;
+
+	if (dev->handle == NULL)
+		return -1;
+
+	dev->options = fetch_options(dev->handle, &dev->resolution_optind,
+				     dev->corners);
+	if (dev->options == NULL)
+		return -1;
+
+	cache_save_options(dev);
+
+	return 0;
+}
+
+/* XXX simd.c */
+
+/* Sample shuffling for the hot loops. Each routine has a portable version
+ * and, on x86, a vector one picked at run time by simd_init().
+ */
+
+static void
+interleave3_scalar(uint8_t *out, const uint8_t *r, const uint8_t *g,
+		   const uint8_t *b, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		out[3 * i] = r[i];
+		out[3 * i + 1] = g[i];
+		out[3 * i + 2] = b[i];
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+/* 16 pixels of each plane make three 16 byte blocks of RGB. every block
+ * takes bytes from the three planes, shuffled into place and or'ed.
+ */
+__attribute__((target("ssse3")))
+static void
+interleave3_ssse3(uint8_t *out, const uint8_t *r, const uint8_t *g,
+		  const uint8_t *b, size_t n)
+{
+	const __m128i r0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1,
+					 -1, 3, -1, -1, 4, -1, -1, 5);
+	const __m128i g0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2,
+					 -1, -1, 3, -1, -1, 4, -1, -1);
+	const __m128i b0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1,
+					 2, -1, -1, 3, -1, -1, 4, -1);
+	const __m128i r1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1,
+					 8, -1, -1, 9, -1, -1, 10, -1);
+	const __m128i g1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1,
+					 -1, 8, -1, -1, 9, -1, -1, 10);
+	const __m128i b1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7,
+					 -1, -1, 8, -1, -1, 9, -1, -1);
+	const __m128i r2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13,
+					 -1, -1, 14, -1, -1, 15, -1, -1);
+	const __m128i g2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1,
+					 13, -1, -1, 14, -1, -1, 15, -1);
+	const __m128i b2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1,
+					 -1, 13, -1, -1, 14, -1, -1, 15);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i vr = _mm_loadu_si128((const __m128i *) (r + i));
+		__m128i vg = _mm_loadu_si128((const __m128i *) (g + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+		__m128i o;
+
+		o = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, r0),
+					      _mm_shuffle_epi8(vg, g0)),
+				 _mm_shuffle_epi8(vb, b0));
+		_mm_storeu_si128((__m128i *) (out + 3 * i), o);
+
+		o = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, r1),
+					      _mm_shuffle_epi8(vg, g1)),
+				 _mm_shuffle_epi8(vb, b1));
+		_mm_storeu_si128((__m128i *) (out + 3 * i + 16), o);
+
+		o = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vr, r2),
+					      _mm_shuffle_epi8(vg, g2)),
+				 _mm_shuffle_epi8(vb, b2));
+		_mm_storeu_si128((__m128i *) (out + 3 * i + 32), o);
+	}
+
+	interleave3_scalar(out + 3 * i, r + i, g + i, b + i, n - i);
+}
+#endif
+
+/* 16 bit samples are handled as bytes, rows need not be aligned */
+static inline uint16_t
+load16(const unsigned char *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void
+store16(unsigned char *p, uint16_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static void
+swap16_scalar(unsigned char *p, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		store16(p + 2 * i, __builtin_bswap16(load16(p + 2 * i)));
+}
+
+/* the low bits of a stretched sample repeat its high ones, so that the
+ * largest value of bits maps to 0xffff
+ */
+static void
+rescale16_scalar(unsigned char *p, size_t n, int bits)
+{
+	uint16_t max = (1 << bits) - 1;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint16_t v = load16(p + 2 * i);
+
+		if (v > max)
+			v = max;
+
+		store16(p + 2 * i, v << (16 - bits) | v >> (2 * bits - 16));
+	}
+}
+
+/* out may be in */
+static void
+reduce16(unsigned char *out, const unsigned char *in, size_t n,
+	 const uint8_t *lut)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = lut[load16(in + 2 * i)];
+}
+
+static uint64_t
+popcount_scalar(const unsigned char *p, size_t n)
+{
+	uint64_t count = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		count += __builtin_popcount(p[i]);
+
+	return count;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("popcnt")))
+static uint64_t
+popcount_popcnt(const unsigned char *p, size_t n)
+{
+	uint64_t count = 0, v;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&v, p + i, sizeof(v));
+		count += __builtin_popcountll(v);
+	}
+
+	return count + popcount_scalar(p + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void
+swap16_sse2(unsigned char *p, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + 2 * i));
+
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *) (p + 2 * i), v);
+	}
+
+	swap16_scalar(p + 2 * i, n - i);
+}
+
+/* there is no unsigned 16 bit min before SSE4.1, v - sat(v - max) is */
+__attribute__((target("sse2")))
+static void
+rescale16_sse2(unsigned char *p, size_t n, int bits)
+{
+	const __m128i max = _mm_set1_epi16((short) ((1 << bits) - 1));
+	const __m128i left = _mm_cvtsi32_si128(16 - bits);
+	const __m128i right = _mm_cvtsi32_si128(2 * bits - 16);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + 2 * i));
+
+		v = _mm_sub_epi16(v, _mm_subs_epu16(v, max));
+		v = _mm_or_si128(_mm_sll_epi16(v, left), _mm_srl_epi16(v, right));
+		_mm_storeu_si128((__m128i *) (p + 2 * i), v);
+	}
+
+	rescale16_scalar(p + 2 * i, n - i, bits);
+}
+
+__attribute__((target("avx2")))
+static void
+swap16_avx2(unsigned char *p, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (p + 2 * i));
+
+		v = _mm256_or_si256(_mm256_slli_epi16(v, 8),
+				    _mm256_srli_epi16(v, 8));
+		_mm256_storeu_si256((__m256i *) (p + 2 * i), v);
+	}
+
+	swap16_scalar(p + 2 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+rescale16_avx2(unsigned char *p, size_t n, int bits)
+{
+	const __m256i max = _mm256_set1_epi16((short) ((1 << bits) - 1));
+	const __m128i left = _mm_cvtsi32_si128(16 - bits);
+	const __m128i right = _mm_cvtsi32_si128(2 * bits - 16);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (p + 2 * i));
+
+		v = _mm256_min_epu16(v, max);
+		v = _mm256_or_si256(_mm256_sll_epi16(v, left),
+				    _mm256_srl_epi16(v, right));
+		_mm256_storeu_si256((__m256i *) (p + 2 * i), v);
+	}
+
+	rescale16_scalar(p + 2 * i, n - i, bits);
+}
+#endif
+
+static void (*interleave3)(uint8_t *out, const uint8_t *r, const uint8_t *g,
+			   const uint8_t *b, size_t n) = interleave3_scalar;
+static void (*swap16)(unsigned char *p, size_t n) = swap16_scalar;
+static void (*rescale16)(unsigned char *p, size_t n, int bits) =
+	rescale16_scalar;
+static uint64_t (*popcount)(const unsigned char *p, size_t n) =
+	popcount_scalar;
+
+static void
+simd_init(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		swap16 = swap16_sse2;
+		rescale16 = rescale16_sse2;
+	}
+
+	if (__builtin_cpu_supports("ssse3"))
+		interleave3 = interleave3_ssse3;
+
+	if (__builtin_cpu_supports("popcnt"))
+		popcount = popcount_popcnt;
+
+	if (__builtin_cpu_supports("avx2")) {
+		swap16 = swap16_avx2;
+		rescale16 = rescale16_avx2;
+	}
+#endif
+}
+
+/* XXX convert.c */
+
+/* 16 bit samples on their way to the encoder. Backends that pad 12 or 14
+ * bit samples have them stretched to the full range, and --output-depth 8
+ * maps them to 8 bits through a gamma curve. Both are done in place on the
+ * buffers the samples were read into. The byte order of the file is left
+ * to libtiff, which swaps while encoding.
+ */
+
+static uint8_t *convert_lut;	/* 16 to 8 bits, stretching included */
+
+static int
+convert_init(void)
+{
+	int v, max = (1 << sample_bits) - 1;
+
+	if (sample_bits < 8 || sample_bits > 16) {
+		printf("sample bits must be between 8 and 16\n");
+		return -1;
+	}
+
+	if (output_depth != 0 && output_depth != 8 && output_depth != 16) {
+		printf("output depth must be 8 or 16\n");
+		return -1;
+	}
+
+	if (output_gamma <= 0) {
+		printf("bad gamma: %g\n", output_gamma);
+		return -1;
+	}
+
+	if (byte_order && strcmp(byte_order, "native") != 0
+	    && strcmp(byte_order, "big") != 0
+	    && strcmp(byte_order, "little") != 0) {
+		printf("unknown byte order: %s\n", byte_order);
+		return -1;
+	}
+
+	if (output_depth != 8 || convert_lut)
+		return 0;
+
+	convert_lut = malloc(65536);
+	if (convert_lut == NULL) {
+		printf("out of memory\n");
+		return -1;
+	}
+
+	for (v = 0; v < 65536; v++) {
+		double x = (double) (v < max ? v : max) / max;
+
+		convert_lut[v] = 255.0 * pow(x, 1.0 / output_gamma) + 0.5;
+	}
+
+	return 0;
+}
+
+/* layout of the samples after convert_rows() */
+static void
+convert_parm(const SANE_Parameters *in, SANE_Parameters *out)
+{
+	*out = *in;
+
+	if (in->depth == 16 && output_depth == 8) {
+		out->depth = 8;
+		out->bytes_per_line = in->bytes_per_line / 2;
+	}
+}
+
+static void
+convert_rows(const SANE_Parameters *parm, SANE_Byte *p, int lines)
+{
+	size_t n = (size_t) lines * parm->bytes_per_line / 2;
+
+	if (parm->depth != 16)
+		return;
+
+	if (convert_lut)
+		reduce16(p, p, n, convert_lut);
+	else if (sample_bits < 16)
+		rescale16(p, n, sample_bits);
+}
+
+/* XXX binarize.c */
+
+/* Gray scans turned into bilevel images as they arrive, for backends
+ * whose lineart modes are poor. Every pixel is compared with a threshold
+ * taken over the window x window square around it, from the mean
+ * (bradley) or from the mean and the standard deviation (sauvola) of its
+ * samples. Only the last window rows are kept, as 8 bit samples, along
+ * with the sums of their columns. A row is thresholded half a window
+ * after it arrives, the rows still pending at the end of the page by
+ * binarize_finish().
+ */
+
+#define BINARIZE_SAUVOLA	1
+#define BINARIZE_BRADLEY	2
+
+#define BINARIZE_MAX_WINDOW	4095	/* the sums of squares fit 32 bits */
+
+static int binarize_method;
+
+struct binarize {
+	int active;
+	SANE_Parameters parm;	/* the bilevel rows */
+	int width;
+	int depth;		/* of the gray samples */
+	int bpl;
+	int window;		/* odd */
+	double k;
+
+	uint32_t rows;		/* received */
+	uint32_t done;		/* thresholded */
+
+	uint8_t *ring;		/* the last window rows */
+	uint32_t *sum;		/* of the columns of the ring */
+	uint32_t *sum2;		/* of their squares */
+	uint64_t *isum;		/* integral of sum along the row */
+	uint64_t *isum2;
+	SANE_Byte *tail;	/* rows thresholded at the end of the page */
+};
+
+static int
+binarize_init(void)
+{
+	binarize_method = 0;
+
+	if (binarize_name == NULL)
+		return 0;
+
+	if (strcmp(binarize_name, "sauvola") == 0) {
+		binarize_method = BINARIZE_SAUVOLA;
+	} else if (strcmp(binarize_name, "bradley") == 0) {
+		binarize_method = BINARIZE_BRADLEY;
+	} else {
+		printf("unknown binarization: %s\n", binarize_name);
+		return -1;
+	}
+
+	/* 0 is the default, 1/8 inch */
+	if (binarize_window < 0 || (binarize_window > 0 && binarize_window < 3)
+	    || binarize_window > BINARIZE_MAX_WINDOW) {
+		printf("binarize window must be between 3 and %d pixels\n",
+		       BINARIZE_MAX_WINDOW);
+		return -1;
+	}
+
+	if (binarize_k < 0 || binarize_k >= 1) {
+		printf("bad binarize k: %g\n", binarize_k);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+binarize_free(struct binarize *b)
+{
+	free(b->ring);
+	free(b->sum);
+	free(b->sum2);
+	free(b->isum);
+	free(b->isum2);
+	free(b->tail);
+	memset(b, 0x00, sizeof(*b));
+}
+
+/* parm is the layout of the gray samples, after convert_rows() */
+static int
+binarize_start(struct binarize *b, const SANE_Parameters *parm,
+	       int resolution)
+{
+	size_t w = parm->pixels_per_line;
+
+	memset(b, 0x00, sizeof(*b));
+
+	b->parm = *parm;
+
+	if (!binarize_method)
+		return 0;
+
+	if (parm->format != SANE_FRAME_GRAY || parm->depth == 1) {
+		printf("only gray images are binarized, not %d bit %s ones\n",
+		       parm->depth, format2name(parm->format));
+		return 0;
+	}
+
+	b->active = 1;
+	b->width = w;
+	b->depth = parm->depth;
+	b->bpl = parm->bytes_per_line;
+	b->parm.depth = 1;
+	b->parm.bytes_per_line = (w + 7) / 8;
+
+	b->window = binarize_window ? binarize_window : resolution / 8;
+	if (b->window < 3)
+		b->window = 3;
+	if (b->window > BINARIZE_MAX_WINDOW)
+		b->window = BINARIZE_MAX_WINDOW;
+	b->window |= 1;
+
+	b->k = binarize_k;
+	if (b->k == 0)
+		b->k = binarize_method == BINARIZE_SAUVOLA ? 0.34 : 0.15;
+
+	if (verbose > 1)
+		printf("binarizing over %d pixels, k %g\n", b->window, b->k);
+
+	b->ring = malloc((size_t) b->window * w);
+	b->sum = calloc(w, sizeof(*b->sum));
+	b->sum2 = calloc(w, sizeof(*b->sum2));
+	b->isum = malloc((w + 1) * sizeof(*b->isum));
+	b->isum2 = malloc((w + 1) * sizeof(*b->isum2));
+	b->tail = malloc((size_t) (b->window / 2) * b->parm.bytes_per_line
+			 + 1);
+
+	if (b->ring == NULL || b->sum == NULL || b->sum2 == NULL
+	    || b->isum == NULL || b->isum2 == NULL || b->tail == NULL) {
+		printf("out of memory\n");
+		binarize_free(b);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* take row i out of the column sums */
+static void
+binarize_drop(struct binarize *b, uint32_t i)
+{
+	const uint8_t *r = b->ring + (size_t) (i % b->window) * b->width;
+	int x;
+
+	for (x = 0; x < b->width; x++) {
+		b->sum[x] -= r[x];
+		b->sum2[x] -= (uint32_t) r[x] * r[x];
+	}
+}
+
+/* the next row goes into the ring, in place of the one a window above */
+static void
+binarize_add(struct binarize *b, const SANE_Byte *p)
+{
+	uint8_t *r = b->ring + (size_t) (b->rows % b->window) * b->width;
+	int x;
+
+	if (b->rows >= (uint32_t) b->window)
+		binarize_drop(b, b->rows - b->window);
+
+	for (x = 0; x < b->width; x++) {
+		r[x] = b->depth == 16 ? load16(p + 2 * x) >> 8 : p[x];
+		b->sum[x] += r[x];
+		b->sum2[x] += (uint32_t) r[x] * r[x];
+	}
+
+	b->rows++;
+}
+
+/* threshold row y against the rows of the ring, which end at b->rows */
+static void
+binarize_row(struct binarize *b, uint32_t y, SANE_Byte *out)
+{
+	const uint8_t *r = b->ring + (size_t) (y % b->window) * b->width;
+	int half = b->window / 2;
+	uint32_t top = y > (uint32_t) half ? y - half : 0;
+	int rows = b->rows - top;
+	int x;
+
+	b->isum[0] = b->isum2[0] = 0;
+	for (x = 0; x < b->width; x++) {
+		b->isum[x + 1] = b->isum[x] + b->sum[x];
+		b->isum2[x + 1] = b->isum2[x] + b->sum2[x];
+	}
+
+	memset(out, 0x00, b->parm.bytes_per_line);
+
+	for (x = 0; x < b->width; x++) {
+		int x0 = x > half ? x - half : 0;
+		int x1 = x + half < b->width ? x + half + 1 : b->width;
+		double n = (double) (x1 - x0) * rows;
+		double mean = (b->isum[x1] - b->isum[x0]) / n;
+		double t;
+
+		if (binarize_method == BINARIZE_SAUVOLA) {
+			double var = (b->isum2[x1] - b->isum2[x0]) / n
+				- mean * mean;
+
+			t = mean * (1 + b->k * (sqrt(var > 0 ? var : 0)
+						/ 128 - 1));
+		} else
+			t = mean * (1 - b->k);
+
+		/* a set bit is black */
+		if (r[x] < t)
+			out[x / 8] |= 0x80 >> (x % 8);
+	}
+}
+
+/* Feed gray rows, the bilevel rows ready by now replace them at the start
+ * of p. Returns how many they are.
+ */
+static int
+binarize_rows(struct binarize *b, SANE_Byte *p, int lines)
+{
+	int half = b->window / 2;
+	int i, n = 0;
+
+	/* a bilevel row is never longer than the gray row it follows */
+	for (i = 0; i < lines; i++) {
+		binarize_add(b, p + (size_t) i * b->bpl);
+
+		if (b->rows > (uint32_t) half)
+			binarize_row(b, b->done++, p + (size_t) n++
+				     * b->parm.bytes_per_line);
+	}
+
+	return n;
+}
+
+/* the rows the page ended before, in *out */
+static int
+binarize_finish(struct binarize *b, SANE_Byte **out)
+{
+	int half = b->window / 2;
+	int n = 0;
+
+	for (; b->done < b->rows; b->done++) {
+		if (b->done > (uint32_t) half)
+			binarize_drop(b, b->done - half - 1);
+
+		binarize_row(b, b->done, b->tail + (size_t) n++
+			     * b->parm.bytes_per_line);
+	}
+
+	*out = b->tail;
+
+	return n;
+}
+
+/* XXX blank.c */
+
+/* Blank pages are told apart by their share of dark samples, counted as
+ * the rows go by: the set bits of bilevel rows, otherwise the samples
+ * below half of the range, from a histogram of their high byte.
+ */
+
+static void
+blank_put_rows(struct stats *st, const SANE_Parameters *parm,
+	       const SANE_Byte *p, int lines)
+{
+	uint32_t hist[256];
+	size_t n, i;
+	int row, k;
+
+	if (parm->depth == 1) {
+		int bits = parm->pixels_per_line % 8;
+		int full = parm->pixels_per_line / 8;
+
+		/* the padding bits of the last byte are not ink */
+		for (row = 0; row < lines; row++) {
+			const SANE_Byte *r = p + (size_t) row
+				* parm->bytes_per_line;
+
+			st->ink += popcount(r, full);
+			if (bits)
+				st->ink += __builtin_popcount(r[full]
+							      >> (8 - bits));
+		}
+
+		st->samples += (uint64_t) lines * parm->pixels_per_line;
+		return;
+	}
+
+	memset(hist, 0x00, sizeof(hist));
+
+	n = (size_t) lines * parm->bytes_per_line;
+
+	if (parm->depth == 16) {
+		for (i = 0; i + 1 < n; i += 2)
+			hist[load16(p + i) >> 8]++;
+		n /= 2;
+	} else {
+		for (i = 0; i < n; i++)
+			hist[p[i]]++;
+	}
+
+	for (k = 0; k < 128; k++)
+		st->ink += hist[k];
+
+	st->samples += n;
+}
+
+static int
+blank_page(const struct stats *st)
+{
+	return skip_blank > 0 && st->samples
+		&& 100.0 * st->ink / st->samples < skip_blank;
+}
+
+/* XXX budget.c */
+
+/* --max-memory bounds what the buffers of the scans hold at once: the
+ * read buffers, the strips queued for the compression threads or waiting
+ * to be written, the write buffers and the pages queued for the worker.
+ * Nothing is refused for lack of budget. Once over it the read buffers
+ * shrink instead of growing, the reader thread lets the encoder empty the
+ * ring before it calls sane_read() again, and the encoder waits for its
+ * strips and pages to be written before taking more scanlines, so that
+ * the scanner is held back rather than more memory allocated.
+ */
+
+struct budget {
+	pthread_mutex_t lock;
+	size_t limit;		/* 0 for none */
+	size_t used;
+	size_t peak;
+	long waits;		/* times the scan was held back */
+};
+
+static struct budget budget = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void
+budget_init(void)
+{
+	pthread_mutex_lock(&budget.lock);
+	budget.limit = max_memory > 0 ? (size_t) max_memory << 20 : 0;
+	budget.peak = budget.used;
+	budget.waits = 0;
+	pthread_mutex_unlock(&budget.lock);
+}
+
+static void
+budget_take(size_t size)
+{
+	pthread_mutex_lock(&budget.lock);
+	budget.used += size;
+	if (budget.used > budget.peak)
+		budget.peak = budget.used;
+	pthread_mutex_unlock(&budget.lock);
+}
+
+static void
+budget_give(size_t size)
+{
+	pthread_mutex_lock(&budget.lock);
+	assert(size <= budget.used);
+	budget.used -= size;
+	pthread_mutex_unlock(&budget.lock);
+}
+
+/* would size more bytes stay within the budget? */
+static int
+budget_fits(size_t size)
+{
+	int fits;
+
+	pthread_mutex_lock(&budget.lock);
+	fits = budget.limit == 0 || budget.used + size <= budget.limit;
+	pthread_mutex_unlock(&budget.lock);
+
+	return fits;
+}
+
+static int
+budget_over(void)
+{
+	return !budget_fits(0);
+}
+
+static void
+budget_held(void)
+{
+	pthread_mutex_lock(&budget.lock);
+	budget.waits++;
+	pthread_mutex_unlock(&budget.lock);
+}
+
+static void
+budget_report(void)
+{
+	char a[32], b[32];
+
+	if (budget.limit)
+		printf("memory: %s at most, of %s, scan held back %ld times\n",
+		       stats_size(a, sizeof(a), budget.peak),
+		       stats_size(b, sizeof(b), budget.limit), budget.waits);
+	else if (show_stats)
+		printf("memory: %s at most\n",
+		       stats_size(a, sizeof(a), budget.peak));
+
+	if (stats_fp) {
+		pthread_mutex_lock(&stats_lock);
+		fprintf(stats_fp, "{\"memory_peak\": %lu, \"memory_limit\": %lu, "
+			"\"memory_waits\": %ld}\n", (unsigned long) budget.peak,
+			(unsigned long) budget.limit, budget.waits);
+		fflush(stats_fp);
+		pthread_mutex_unlock(&stats_lock);
+	}
+}
+
+/* XXX pipeline.c */
+
+/* The reader thread only drains sane_read() into a ring of buffers,
+ * the encoder (the caller of ring_get) feeds libtiff. This keeps the
+ * scanner streaming while zlib or G4 are busy.
+ *
+ * How much is asked of each sane_read() follows what the backend gives:
+ * a read that fills the buffer doubles it, a run of reads that use less
+ * than a quarter of it halves it, within --read-buffer bounds. Slots are
+ * resized by the reader, just before filling them.
+ */
+
+#define RING_MIN_SIZE		(64 * 1024)
+#define RING_START_SIZE		(256 * 1024)
+#define RING_MAX_SIZE		(8 * 1024 * 1024)
+#define RING_SHORT_READS	8
+
+static size_t ring_min_size = RING_MIN_SIZE;
+static size_t ring_max_size = RING_MAX_SIZE;
+
+struct ring_slot {
+	SANE_Byte *data;
+	SANE_Int len;
+	size_t size;		/* allocated */
+};
+
+struct ring {
+	SANE_Handle handle;
+	pthread_t reader;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+
+	struct ring_slot *slots;
+	int nslots;
+	int depth;		/* 0 means sane_read() on the caller's thread */
+
+	/* reader only */
+	size_t read_size;	/* asked of sane_read(), whole scanlines */
+	size_t min_size, max_size;
+	size_t line;
+	int short_reads;
+
+	int head;		/* next slot to be consumed */
+	int count;		/* slots holding data */
+	int done;		/* reader has stopped, see status */
+	int abort;		/* encoder gave up, reader must stop */
+	SANE_Status status;
+
+	/* how many times either side had to wait for the other */
+	int reader_waits;
+	int encoder_waits;
+
+	struct stats *stats;	/* reads by the reader, waits by either */
+};
+
+/* keep size between the bounds, in whole scanlines */
+static size_t
+ring_clamp(struct ring *r, size_t size)
+{
+	if (size < r->min_size)
+		size = r->min_size;
+	if (size > r->max_size)
+		size = r->max_size;
+
+	size -= size % r->line;
+
+	return size ? size : r->line;
+}
+
+static void
+ring_adapt(struct ring *r, SANE_Int len)
+{
+	size_t size;
+
+	if (budget_over()) {
+		/* give some back, the slots shrink as they are refilled */
+		r->short_reads = 0;
+		size = r->read_size / 2;
+	} else if ((size_t) len == r->read_size) {
+		r->short_reads = 0;
+		size = r->read_size * 2;
+
+		/* every slot will grow */
+		if (!budget_fits((size - r->read_size) * r->nslots))
+			return;
+	} else if ((size_t) len < r->read_size / 4) {
+		if (++r->short_reads < RING_SHORT_READS)
+			return;
+
+		r->short_reads = 0;
+		size = r->read_size / 2;
+	} else {
+		r->short_reads = 0;
+		return;
+	}
+
+	r->read_size = ring_clamp(r, size);
+
+	if (r->read_size > r->stats->read_buffer_max)
+		r->stats->read_buffer_max = r->read_size;
+}
+
+/* one sane_read() into the slot, grown or shrunk to the current size */
+static SANE_Status
+ring_read(struct ring *r, struct ring_slot *slot)
+{
+	SANE_Status status;
+	double t0;
+
+	if (slot->size < r->read_size || slot->size > 2 * r->read_size) {
+		SANE_Byte *data = realloc(slot->data, r->read_size);
+
+		if (data == NULL)
+			return SANE_STATUS_NO_MEM;
+
+		budget_give(slot->size);
+		budget_take(r->read_size);
+
+		slot->data = data;
+		slot->size = r->read_size;
+	}
+
+	t0 = stats_clock();
+	status = source->read(r->handle, slot->data, r->read_size,
+			      &slot->len);
+	stats_read(r->stats, t0, stats_clock(), slot->len);
+
+	if (status == SANE_STATUS_GOOD)
+		ring_adapt(r, slot->len);
+
+	return status;
+}
+
+static void *
+ring_reader(void *arg)
+{
+	struct ring *r = arg;
+	struct ring_slot *slot;
+	SANE_Status status;
+	double t0;
+
+	while (1) {
+		pthread_mutex_lock(&r->lock);
+
+		if (r->count == r->depth) {
+			r->reader_waits++;
+
+			t0 = stats_clock();
+			while (r->count == r->depth && !r->abort)
+				pthread_cond_wait(&r->drained, &r->lock);
+			r->stats->blocked_time += stats_clock() - t0;
+		}
+
+		/* over the budget, let the encoder catch up first */
+		if (r->count && budget_over()) {
+			budget_held();
+
+			t0 = stats_clock();
+			while (r->count && !r->abort && budget_over())
+				pthread_cond_wait(&r->drained, &r->lock);
+			r->stats->blocked_time += stats_clock() - t0;
+		}
+
+		if (r->abort) {
+			r->done = 1;
+			pthread_mutex_unlock(&r->lock);
+			break;
+		}
+
+		slot = &r->slots[(r->head + r->count) % r->depth];
+
+		pthread_mutex_unlock(&r->lock);
+
+		status = ring_read(r, slot);
+
+		/* no data? keep reading */
+		if (status == SANE_STATUS_GOOD && slot->len == 0)
+			continue;
+
+		pthread_mutex_lock(&r->lock);
+
+		if (status == SANE_STATUS_GOOD) {
+			r->count++;
+		} else {
+			r->status = status;
+			r->done = 1;
+		}
+
+		pthread_cond_signal(&r->filled);
+		pthread_mutex_unlock(&r->lock);
+
+		if (status != SANE_STATUS_GOOD)
+			break;
+	}
+
+	return NULL;
+}
+
+/* --read-buffer MIN[:MAX], in Kb */
+static int
+ring_parse_size(const char *arg)
+{
+	int min, max;
+
+	switch (sscanf(arg, "%d:%d", &min, &max)) {
+	case 1:
+		max = min;
+		break;
+	case 2:
+		break;
+	default:
+		return -1;
+	}
+
+	if (min <= 0 || max < min)
+		return -1;
+
+	ring_min_size = (size_t) min * 1024;
+	ring_max_size = (size_t) max * 1024;
+
+	return 0;
+}
+
+/* sizes are in bytes, min == max gives a fixed size */
+static int
+ring_init(struct ring *r, SANE_Handle handle, int depth, size_t line,
+	  size_t min_size, size_t max_size, struct stats *stats)
+{
+	memset(r, 0x00, sizeof(*r));
+
+	r->handle = handle;
+	r->stats = stats;
+
+	r->nslots = depth > 0 ? depth : 1;
+	r->depth = depth > 0 ? depth : 0;
+	r->status = SANE_STATUS_GOOD;
+
+	r->line = line;
+	r->min_size = min_size;
+	r->max_size = max_size;
+	r->read_size = ring_clamp(r, RING_START_SIZE);
+
+	stats->read_buffer_max = r->read_size;
+
+	/* slots get their buffers on first use */
+	r->slots = calloc(r->nslots, sizeof(struct ring_slot));
+	if (r->slots == NULL)
+		return -1;
+
+	if (r->depth == 0)
+		return 0;
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->filled, NULL);
+	pthread_cond_init(&r->drained, NULL);
+
+	if (pthread_create(&r->reader, NULL, ring_reader, r) != 0) {
+		printf("cannot start the reader thread, reading inline\n");
+
+		pthread_mutex_destroy(&r->lock);
+		pthread_cond_destroy(&r->filled);
+		pthread_cond_destroy(&r->drained);
+
+		r->depth = 0;
+	}
+
+	return 0;
+}
+
+/* returns the oldest filled slot, which stays valid until ring_put() */
+static SANE_Status
+ring_get(struct ring *r, struct ring_slot **slot)
+{
+	SANE_Status status;
+	double t0;
+
+	if (r->depth == 0) {
+		*slot = &r->slots[0];
+
+		do {
+			status = ring_read(r, *slot);
+		} while (status == SANE_STATUS_GOOD && (*slot)->len == 0);
+
+		return status;
+	}
+
+	pthread_mutex_lock(&r->lock);
+
+	if (r->count == 0 && !r->done) {
+		r->encoder_waits++;
+
+		t0 = stats_clock();
+		while (r->count == 0 && !r->done)
+			pthread_cond_wait(&r->filled, &r->lock);
+		r->stats->wait_time += stats_clock() - t0;
+	}
+
+	if (r->count) {
+		*slot = &r->slots[r->head];
+		status = SANE_STATUS_GOOD;
+	} else {
+		status = r->status;
+	}
+
+	pthread_mutex_unlock(&r->lock);
+
+	return status;
+}
+
+static void
+ring_put(struct ring *r)
+{
+	if (r->depth == 0)
+		return;
+
+	pthread_mutex_lock(&r->lock);
+
+	r->head = (r->head + 1) % r->depth;
+	r->count--;
+
+	pthread_cond_signal(&r->drained);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* stop the reader early, the current scan is cancelled */
+static void
+ring_abort(struct ring *r)
+{
+	source->cancel(r->handle);
+
+	if (r->depth == 0)
+		return;
+
+	pthread_mutex_lock(&r->lock);
+
+	r->abort = 1;
+
+	pthread_cond_signal(&r->drained);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* must be called once ring_get() has returned something other than GOOD,
+ * or after ring_abort()
+ */
+static void
+ring_finish(struct ring *r)
+{
+	int i;
+
+	if (r->depth) {
+		pthread_join(r->reader, NULL);
+
+		if (verbose)
+			printf("pipeline: %d buffers of %ld Kb at last, reader "
+			       "waited %d times, encoder waited %d times\n",
+			       r->depth, r->read_size / 1024, r->reader_waits,
+			       r->encoder_waits);
+
+		r->stats->reader_waits += r->reader_waits;
+		r->stats->encoder_waits += r->encoder_waits;
+
+		pthread_mutex_destroy(&r->lock);
+		pthread_cond_destroy(&r->filled);
+		pthread_cond_destroy(&r->drained);
+	}
+
+	for (i = 0; i < r->nslots; i++) {
+		budget_give(r->slots[i].size);
+		free(r->slots[i].data);
+	}
+
+	free(r->slots);
+}
+
+/* A pool of compression threads. Jobs are run in submission order but
+ * may complete in any order, the submitter waits for them with pool_wait().
+ */
+
+struct job {
+	struct job *next;
+	void (*run)(struct job *);
+	int done;
+	int detached;		/* freed once run, nobody waits for it */
+};
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+
+	pthread_t *threads;
+	int nthreads;
+
+	struct job *head, *tail;
+	int stop;
+};
+
+static struct pool *pool;
+/* started by the first scan thread that needs it */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+pool_worker(void *arg)
+{
+	struct pool *p = arg;
+	struct job *job;
+
+	pthread_mutex_lock(&p->lock);
+
+	while (1) {
+		while (p->head == NULL && !p->stop)
+			pthread_cond_wait(&p->work, &p->lock);
+
+		if (p->head == NULL)
+			break;
+
+		job = p->head;
+		p->head = job->next;
+		if (p->head == NULL)
+			p->tail = NULL;
+
+		pthread_mutex_unlock(&p->lock);
+
+		job->run(job);
+
+		pthread_mutex_lock(&p->lock);
+
+		if (job->detached) {
+			free(job);
+			continue;
+		}
+
+		job->done = 1;
+		pthread_cond_broadcast(&p->done);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+/* asked for with --threads, 0 compresses inline */
+static int
+pool_threads(void)
+{
+	int n;
+
+	if (threads == 0)
+		return 0;
+
+	n = threads > 0 ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+static struct pool *
+pool_create(int nthreads)
+{
+	struct pool *p;
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return NULL;
+
+	p->threads = calloc(nthreads, sizeof(pthread_t));
+	if (p->threads == NULL) {
+		free(p);
+		return NULL;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	for (p->nthreads = 0; p->nthreads < nthreads; p->nthreads++) {
+		if (pthread_create(&p->threads[p->nthreads], NULL,
+				   pool_worker, p) != 0)
+			break;
+	}
+
+	if (verbose > 1)
+		printf("started %d compression threads\n", p->nthreads);
+
+	return p;
+}
+
+static void
+pool_destroy(struct pool *p)
+{
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < p->nthreads; i++)
+		pthread_join(p->threads[i], NULL);
+
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->work);
+	pthread_cond_destroy(&p->done);
+
+	free(p->threads);
+	free(p);
+}
+
+/* without a pool (or threads) the job is run right away */
+static void
+pool_submit(struct pool *p, struct job *job)
+{
+	job->next = NULL;
+	job->done = 0;
+
+	if (p == NULL || p->nthreads == 0) {
+		job->run(job);
+
+		if (job->detached)
+			free(job);
+		else
+			job->done = 1;
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+
+	if (p->tail)
+		p->tail->next = job;
+	else
+		p->head = job;
+	p->tail = job;
+
+	pthread_cond_signal(&p->work);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static int
+pool_done(struct pool *p, struct job *job)
+{
+	int done;
+
+	if (p == NULL || p->nthreads == 0)
+		return 1;
+
+	pthread_mutex_lock(&p->lock);
+	done = job->done;
+	pthread_mutex_unlock(&p->lock);
+
+	return done;
+}
+
+static void
+pool_wait(struct pool *p, struct job *job)
+{
+	if (p == NULL || p->nthreads == 0)
+		return;
+
+	pthread_mutex_lock(&p->lock);
+	while (!job->done)
+		pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* XXX tiff.c */
+
+/* In-memory TIFF files, used to run the libtiff codecs on a single
+ * strip away from the output file.
+ */
+
+struct membuf {
+	unsigned char *data;
+	toff_t size;
+	toff_t alloc;
+	toff_t pos;
+};
+
+static tmsize_t
+mem_read(thandle_t h, void *buf, tmsize_t n)
+{
+	struct membuf *mb = h;
+
+	if (mb->pos >= mb->size)
+		return 0;
+
+	if ((toff_t) n > mb->size - mb->pos)
+		n = mb->size - mb->pos;
+
+	memcpy(buf, mb->data + mb->pos, n);
+	mb->pos += n;
+
+	return n;
+}
+
+/* room for size bytes in all */
+static int
+mem_reserve(struct membuf *mb, toff_t size)
+{
+	toff_t alloc = mb->alloc ? mb->alloc : 64 * 1024;
+	unsigned char *data;
+
+	if (size <= mb->alloc)
+		return 0;
+
+	while (alloc < size)
+		alloc *= 2;
+
+	data = realloc(mb->data, alloc);
+	if (data == NULL)
+		return -1;
+
+	budget_take(alloc - mb->alloc);
+
+	mb->data = data;
+	mb->alloc = alloc;
+
+	return 0;
+}
+
+static tmsize_t
+mem_write(thandle_t h, void *buf, tmsize_t n)
+{
+	struct membuf *mb = h;
+
+	if (mem_reserve(mb, mb->pos + n) != 0)
+		return -1;
+
+	/* fill any hole left by a seek past the end */
+	if (mb->pos > mb->size)
+		memset(mb->data + mb->size, 0x00, mb->pos - mb->size);
+
+	memcpy(mb->data + mb->pos, buf, n);
+	mb->pos += n;
+
+	if (mb->pos > mb->size)
+		mb->size = mb->pos;
+
+	return n;
+}
+
+static toff_t
+mem_seek(thandle_t h, toff_t off, int whence)
+{
+	struct membuf *mb = h;
+
+	switch (whence) {
+	case SEEK_SET:
+		mb->pos = off;
+		break;
+	case SEEK_CUR:
+		mb->pos += off;
+		break;
+	case SEEK_END:
+		mb->pos = mb->size + off;
+		break;
+	}
+
+	return mb->pos;
+}
+
+static int
+mem_close(thandle_t h)
+{
+	return 0;
+}
+
+static toff_t
+mem_size(thandle_t h)
+{
+	return ((struct membuf *) h)->size;
+}
+
+static int
+mem_map(thandle_t h, void **base, toff_t *size)
+{
+	return 0;
+}
+
+static void
+mem_unmap(thandle_t h, void *base, toff_t size)
+{
+}
+
+static TIFF *
+mem_open(struct membuf *mb, const char *mode)
+{
+	return TIFFClientOpen("memory", mode, mb, mem_read, mem_write,
+			      mem_seek, mem_close, mem_size,
+			      mem_map, mem_unmap);
+}
+
+/* Strip output: scanlines are gathered into strips, compressed on the
+ * pool and written in order with TIFFWriteRawStrip().
+ *
+ * Tiled output works the same way on bands of tile height: each band
+ * is cut into tiles, which are encoded as a strip of the tile size and
+ * written with TIFFWriteRawTile().
+ */
+
+struct strip_job {
+	struct job job;		/* must be first */
+	struct strip_job *next;
+
+	const SANE_Parameters *parm;
+	uint32_t index;
+	int rows;
+
+	SANE_Byte *data;	/* raw scanlines */
+	tmsize_t size;
+	size_t data_alloc;
+
+	unsigned char *out;	/* encoded strip, may alias data */
+	tmsize_t out_size;
+	size_t out_alloc;	/* unless it does */
+};
+
+struct strips {
+	TIFF *image;
+	const SANE_Parameters *parm;
+	int rows_per_strip;	/* or band height when tiled */
+	int active;
+
+	struct strip_job *cur;	/* being filled */
+	uint32_t index;		/* of the next strip or tile */
+	uint32_t rows;		/* written to the file so far */
+
+	/* one plane of a PLANARCONFIG_SEPARATE image, its height is set */
+	int planar;
+	uint16_t sample;
+
+	/* tiled output */
+	int tiled;
+	SANE_Parameters tile;	/* layout of a single tile */
+	int tiles_across;
+	int bands;		/* in the whole image */
+	int band;		/* next band to be submitted */
+	SANE_Byte *band_data;
+	int band_rows;
+
+	struct strip_job *head, *tail;	/* submitted, in file order */
+	int pending;
+	int max_pending;
+	int deferred;		/* no image yet, keep the encoded strips */
+
+	int error;
+};
+
+static void
+strip_encode(struct job *job)
+{
+	struct strip_job *sj = (struct strip_job *) job;
+	struct membuf mb;
+	uint64_t *offsets, *counts;
+	uint64_t offset = 0;
+	char mode[4];
+	TIFF *mt;
+
+	sj->out = NULL;
+	sj->out_size = -1;
+
+	if (tiff_compression(sj->parm) == COMPRESSION_NONE) {
+		/* libtiff does not see these, swap the samples here */
+		if (sj->parm->depth == 16 && tiff_swab())
+			swap16(sj->data, sj->size / 2);
+
+		sj->out = sj->data;
+		sj->out_size = sj->size;
+		return;
+	}
+
+	memset(&mb, 0x00, sizeof(mb));
+
+	/* in the byte order of the file, libtiff swaps while encoding */
+	snprintf(mode, sizeof(mode), "w%s", tiff_byte_order());
+
+	mt = mem_open(&mb, mode);
+	if (mt == NULL)
+		return;
+
+	tiff_set_format(mt, sj->parm);
+	TIFFSetField(mt, TIFFTAG_IMAGELENGTH, sj->rows);
+	TIFFSetField(mt, TIFFTAG_ROWSPERSTRIP, sj->rows);
+
+	if (TIFFWriteEncodedStrip(mt, 0, sj->data, sj->size) >= 0
+	    && TIFFGetField(mt, TIFFTAG_STRIPOFFSETS, &offsets)
+	    && TIFFGetField(mt, TIFFTAG_STRIPBYTECOUNTS, &counts)) {
+		offset = offsets[0];
+		sj->out_size = counts[0];
+	}
+
+	/* this might append a directory, which we do not need */
+	TIFFCleanup(mt);
+
+	if (sj->out_size >= 0) {
+		/* keep the buffer, drop the TIFF header */
+		memmove(mb.data, mb.data + offset, sj->out_size);
+		sj->out = mb.data;
+		sj->out_alloc = mb.alloc;
+	} else {
+		budget_give(mb.alloc);
+		free(mb.data);
+	}
+}
+
+static void
+strip_free(struct strip_job *sj)
+{
+	if (sj->out != sj->data) {
+		budget_give(sj->out_alloc);
+		free(sj->out);
+	}
+
+	if (sj->data)
+		budget_give(sj->data_alloc);
+	free(sj->data);
+	free(sj);
+}
+
+static struct strip_job *
+strip_alloc(struct strips *s, const SANE_Parameters *parm, int rows)
+{
+	struct strip_job *sj;
+
+	sj = calloc(1, sizeof(*sj));
+	if (sj == NULL)
+		return NULL;
+
+	sj->data_alloc = (size_t) rows * parm->bytes_per_line;
+	sj->data = malloc(sj->data_alloc);
+	if (sj->data == NULL) {
+		free(sj);
+		return NULL;
+	}
+
+	budget_take(sj->data_alloc);
+
+	sj->parm = parm;
+	sj->index = s->index++;
+	sj->job.run = strip_encode;
+
+	return sj;
+}
+
+/* without an image the encoded strips are held until strips_write() */
+static void
+strips_init(struct strips *s, TIFF *image, const SANE_Parameters *parm,
+	    int rows, int tiles)
+{
+	memset(s, 0x00, sizeof(*s));
+
+	s->image = image;
+	s->parm = parm;
+	s->rows_per_strip = rows;
+	s->deferred = image == NULL;
+
+	if (tiles) {
+		int size = tiff_tile_size();
+
+		s->tiled = 1;
+		s->rows_per_strip = size;
+
+		s->tile = *parm;
+		s->tile.pixels_per_line = size;
+		s->tile.lines = size;
+		s->tile.bytes_per_line = parm->depth == 1 ? size / 8 :
+			size * (parm->bytes_per_line / parm->pixels_per_line);
+
+		s->tiles_across = (parm->pixels_per_line + size - 1) / size;
+		s->bands = (parm->lines + size - 1) / size;
+
+		s->band_data = malloc((size_t) size * parm->bytes_per_line);
+		if (s->band_data == NULL) {
+			printf("out of memory\n");
+			s->error = 1;
+		}
+	} else if (tiled && verbose && image) {
+		printf("image height is not known, writing strips instead of tiles\n");
+	}
+
+	s->active = s->tiled || s->rows_per_strip > 1;
+
+	if (s->active && pool_threads()) {
+		pthread_mutex_lock(&pool_lock);
+		if (pool == NULL)
+			pool = pool_create(pool_threads());
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	/* enough to keep every thread busy while the oldest one is written */
+	s->max_pending = pool ? 2 * pool->nthreads : 1;
+
+	if (s->deferred)
+		return;
+
+	if (verbose > 1 && s->tiled)
+		printf("writing %dx%d tiles of %dx%d pixels\n",
+		       s->tiles_across, s->bands,
+		       s->tile.pixels_per_line, s->tile.lines);
+	else if (verbose > 1 && s->active)
+		printf("writing strips of %d scanlines\n", s->rows_per_strip);
+}
+
+/* deferred strips only give back their scanlines once encoded */
+static void
+strips_release(struct strips *s)
+{
+	struct strip_job *sj;
+
+	for (sj = s->head; sj; sj = sj->next) {
+		if (sj->data && pool_done(pool, &sj->job)
+		    && sj->out != sj->data) {
+			budget_give(sj->data_alloc);
+			free(sj->data);
+			sj->data = NULL;
+		}
+	}
+}
+
+/* write the completed strips at the head of the queue. with wait set, all
+ * of them are waited for, otherwise only when too many are in flight.
+ */
+static void
+strips_drain(struct strips *s, int wait)
+{
+	struct strip_job *sj;
+
+	if (s->deferred) {
+		/* over the budget, wait for the scanlines to be encoded */
+		if (budget_over()) {
+			budget_held();
+			for (sj = s->head; sj; sj = sj->next)
+				pool_wait(pool, &sj->job);
+		}
+
+		strips_release(s);
+		return;
+	}
+
+	while ((sj = s->head) != NULL) {
+
+		if (!pool_done(pool, &sj->job)) {
+			if (!wait && s->pending < s->max_pending
+			    && !budget_over())
+				break;
+
+			if (!wait && s->pending < s->max_pending)
+				budget_held();
+
+			pool_wait(pool, &sj->job);
+		}
+
+		if (sj->out_size < 0 && !s->error) {
+			printf("cannot compress strip %u\n", sj->index);
+			s->error = 1;
+		}
+
+		if (!s->error && s->tiled) {
+			if (TIFFWriteRawTile(s->image, sj->index, sj->out,
+					     sj->out_size) < 0)
+				s->error = 1;
+		} else if (!s->error) {
+			if (!s->planar)
+				TIFFSetField(s->image, TIFFTAG_IMAGELENGTH,
+					     s->rows + sj->rows);
+
+			if (TIFFWriteRawStrip(s->image, sj->index, sj->out,
+					      sj->out_size) < 0)
+				s->error = 1;
+			else
+				s->rows += sj->rows;
+		}
+
+		s->head = sj->next;
+		if (s->head == NULL)
+			s->tail = NULL;
+		s->pending--;
+
+		strip_free(sj);
+	}
+}
+
+static void
+strips_submit(struct strips *s, struct strip_job *sj)
+{
+	sj->size = (tmsize_t) sj->rows * sj->parm->bytes_per_line;
+
+	if (s->tail)
+		s->tail->next = sj;
+	else
+		s->head = sj;
+	s->tail = sj;
+	s->pending++;
+
+	pool_submit(pool, &sj->job);
+
+	strips_drain(s, 0);
+}
+
+/* cut the current band into tiles, unused rows and columns are blank */
+static void
+strips_submit_band(struct strips *s)
+{
+	int bpl = s->parm->bytes_per_line;
+	int tbpl = s->tile.bytes_per_line;
+	int i, row;
+
+	for (i = 0; i < s->tiles_across && !s->error; i++) {
+		struct strip_job *sj;
+		int offset = i * tbpl;
+		int n = bpl - offset < tbpl ? bpl - offset : tbpl;
+
+		sj = strip_alloc(s, &s->tile, s->tile.lines);
+		if (sj == NULL) {
+			printf("out of memory\n");
+			s->error = 1;
+			break;
+		}
+
+		sj->rows = s->tile.lines;
+		memset(sj->data, 0x00, (size_t) sj->rows * tbpl);
+
+		for (row = 0; row < s->band_rows; row++)
+			memcpy(sj->data + (size_t) row * tbpl,
+			       s->band_data + (size_t) row * bpl + offset, n);
+
+		strips_submit(s, sj);
+	}
+
+	s->band++;
+	s->band_rows = 0;
+}
+
+static int
+strips_put_band(struct strips *s, const SANE_Byte *p, int lines)
+{
+	int bpl = s->parm->bytes_per_line;
+
+	while (lines > 0 && s->band < s->bands && !s->error) {
+		int n = s->rows_per_strip - s->band_rows;
+
+		if (n > lines)
+			n = lines;
+
+		memcpy(s->band_data + (size_t) s->band_rows * bpl, p,
+		       (size_t) n * bpl);
+
+		s->band_rows += n;
+		p += (size_t) n * bpl;
+		lines -= n;
+
+		if (s->band_rows == s->rows_per_strip)
+			strips_submit_band(s);
+	}
+
+	/* anything past the announced height is dropped */
+
+	return s->error ? -1 : 0;
+}
+
+static int
+strips_put(struct strips *s, const SANE_Byte *p, int lines)
+{
+	int bpl = s->parm->bytes_per_line;
+
+	if (s->tiled)
+		return strips_put_band(s, p, lines);
+
+	while (lines > 0 && !s->error) {
+		int n;
+
+		if (s->cur == NULL) {
+			s->cur = strip_alloc(s, s->parm, s->rows_per_strip);
+			if (s->cur == NULL) {
+				printf("out of memory\n");
+				s->error = 1;
+				break;
+			}
+		}
+
+		n = s->rows_per_strip - s->cur->rows;
+		if (n > lines)
+			n = lines;
+
+		memcpy(s->cur->data + (size_t) s->cur->rows * bpl, p,
+		       (size_t) n * bpl);
+
+		s->cur->rows += n;
+		p += (size_t) n * bpl;
+		lines -= n;
+
+		if (s->cur->rows == s->rows_per_strip) {
+			strips_submit(s, s->cur);
+			s->cur = NULL;
+		}
+	}
+
+	return s->error ? -1 : 0;
+}
+
+/* flush the last, possibly short, strip and wait for all of them. a
+ * tiled image gets blank tiles for whatever the scanner did not send.
+ */
+static int
+strips_finish(struct strips *s)
+{
+	if (s->cur && s->cur->rows && !s->error) {
+		strips_submit(s, s->cur);
+		s->cur = NULL;
+	}
+
+	if (s->cur) {
+		strip_free(s->cur);
+		s->cur = NULL;
+	}
+
+	if (s->tiled) {
+		while (s->band < s->bands && !s->error)
+			strips_submit_band(s);
+
+		free(s->band_data);
+		s->band_data = NULL;
+	}
+
+	strips_drain(s, 1);
+
+	return s->error ? -1 : 0;
+}
+
+/* write deferred strips to the current directory of image */
+static int
+strips_write(struct strips *s, TIFF *image)
+{
+	s->image = image;
+	s->deferred = 0;
+
+	strips_drain(s, 1);
+
+	return s->error ? -1 : 0;
+}
+
+/* throw away anything still queued */
+static void
+strips_free(struct strips *s)
+{
+	struct strip_job *sj;
+
+	while ((sj = s->head) != NULL) {
+		pool_wait(pool, &sj->job);
+
+		s->head = sj->next;
+		strip_free(sj);
+	}
+
+	s->tail = NULL;
+	s->pending = 0;
+
+	if (s->cur) {
+		strip_free(s->cur);
+		s->cur = NULL;
+	}
+
+	free(s->band_data);
+	s->band_data = NULL;
+}
+
+/* Pyramids: every level halves the previous one with a 2x2 box filter as
+ * the scanlines arrive. The levels are encoded on the pool while the page
+ * is scanned and written as SubIFDs right after the page directory.
+ */
+
+#define PYRAMID_MAX_LEVELS 16
+#define PYRAMID_MIN_SIZE 256
+
+struct level {
+	SANE_Parameters parm;
+	struct strips strips;
+
+	SANE_Byte *pending;	/* even row waiting for its pair */
+	int have_pending;
+	SANE_Byte *row;		/* reduced row */
+};
+
+struct pyramid {
+	SANE_Parameters parm;
+	int resolution;
+	int nlevels;
+	struct level level[PYRAMID_MAX_LEVELS];
+	int error;
+};
+
+static void
+pyramid_free(struct pyramid *p)
+{
+	int i;
+
+	for (i = 0; i < p->nlevels; i++) {
+		strips_free(&p->level[i].strips);
+		free(p->level[i].pending);
+		free(p->level[i].row);
+	}
+
+	free(p);
+}
+
+static struct pyramid *
+pyramid_create(const SANE_Parameters *parm, int resolution)
+{
+	struct pyramid *p;
+	const SANE_Parameters *src;
+	int w = parm->pixels_per_line;
+	int h = parm->lines > 0 ? parm->lines : parm->pixels_per_line;
+	int n;
+
+	if (parm->depth != 8 && parm->depth != 16) {
+		printf("pyramids need 8 or 16 bit samples, not building one\n");
+		return NULL;
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return NULL;
+
+	p->parm = *parm;
+	p->resolution = resolution;
+
+	src = &p->parm;
+
+	for (n = 0; n < PYRAMID_MAX_LEVELS; n++) {
+		struct level *l = &p->level[n];
+		int spp = tiff_samples(src);
+
+		if (pyramid_levels > 0 && n == pyramid_levels)
+			break;
+
+		if ((w > h ? w : h) >> (n + 1) < PYRAMID_MIN_SIZE
+		    || (w < h ? w : h) >> (n + 1) < 1)
+			break;
+
+		l->parm = *src;
+		l->parm.pixels_per_line = (src->pixels_per_line + 1) / 2;
+		l->parm.lines = src->lines > 0 ? (src->lines + 1) / 2 : -1;
+		l->parm.bytes_per_line = l->parm.pixels_per_line * spp
+			* (src->depth / 8);
+
+		l->pending = malloc(src->bytes_per_line);
+		l->row = malloc(l->parm.bytes_per_line);
+
+		p->nlevels++;
+
+		if (l->pending == NULL || l->row == NULL) {
+			pyramid_free(p);
+			return NULL;
+		}
+
+		strips_init(&l->strips, NULL, &l->parm,
+			    tiff_round_rows(&l->parm, STRIP_AUTO_SIZE
+					    / l->parm.bytes_per_line + 1), 0);
+
+		src = &l->parm;
+	}
+
+	if (p->nlevels == 0) {
+		free(p);
+		return NULL;
+	}
+
+	if (verbose > 1)
+		printf("building %d reduced resolution levels\n", p->nlevels);
+
+	return p;
+}
+
+/* average two rows of src into a row of half the width */
+static void
+pyramid_reduce(const SANE_Parameters *src, const SANE_Byte *a,
+	       const SANE_Byte *b, SANE_Byte *out, int width)
+{
+	int spp = tiff_samples(src);
+	int last = src->pixels_per_line - 1;
+	int x, c;
+
+	for (x = 0; x < width; x++) {
+		int x0 = 2 * x * spp;
+		int x1 = (2 * x < last ? 2 * x + 1 : last) * spp;
+
+		for (c = 0; c < spp; c++) {
+			if (src->depth == 16) {
+				const uint16_t *a16 = (const uint16_t *) a;
+				const uint16_t *b16 = (const uint16_t *) b;
+
+				((uint16_t *) out)[x * spp + c] =
+					(a16[x0 + c] + a16[x1 + c]
+					 + b16[x0 + c] + b16[x1 + c] + 2) >> 2;
+			} else {
+				out[x * spp + c] =
+					(a[x0 + c] + a[x1 + c]
+					 + b[x0 + c] + b[x1 + c] + 2) >> 2;
+			}
+		}
+	}
+}
+
+static void
+pyramid_put(struct pyramid *p, int n, const SANE_Byte *row)
+{
+	struct level *l = &p->level[n];
+	const SANE_Parameters *src = n ? &p->level[n - 1].parm : &p->parm;
+
+	if (!l->have_pending) {
+		memcpy(l->pending, row, src->bytes_per_line);
+		l->have_pending = 1;
+		return;
+	}
+
+	pyramid_reduce(src, l->pending, row, l->row, l->parm.pixels_per_line);
+	l->have_pending = 0;
+
+	if (strips_put(&l->strips, l->row, 1) != 0)
+		p->error = 1;
+
+	if (n + 1 < p->nlevels)
+		pyramid_put(p, n + 1, l->row);
+}
+
+static void
+pyramid_put_rows(struct pyramid *p, const SANE_Byte *rows, int lines)
+{
+	int i;
+
+	for (i = 0; i < lines; i++)
+		pyramid_put(p, 0, rows + (size_t) i * p->parm.bytes_per_line);
+}
+
+/* an odd row left at the bottom of a level is paired with itself */
+static int
+pyramid_finish(struct pyramid *p)
+{
+	int n;
+
+	for (n = 0; n < p->nlevels; n++) {
+		struct level *l = &p->level[n];
+
+		if (l->have_pending)
+			pyramid_put(p, n, l->pending);
+
+		if (strips_finish(&l->strips) != 0)
+			p->error = 1;
+	}
+
+	return p->error ? -1 : 0;
+}
+
+/* the page directory has just been written, the next ones are its SubIFDs */
+static int
+pyramid_write(struct pyramid *p, TIFF *image)
+{
+	int n;
+
+	for (n = 0; n < p->nlevels && !p->error; n++) {
+		struct level *l = &p->level[n];
+		float resolution = (float) p->resolution / (2 << n);
+
+		TIFFSetField(image, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+		tiff_set_format(image, &l->parm);
+		TIFFSetField(image, TIFFTAG_ROWSPERSTRIP,
+			     l->strips.rows_per_strip);
+
+		TIFFSetField(image, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH);
+		TIFFSetField(image, TIFFTAG_XRESOLUTION, resolution);
+		TIFFSetField(image, TIFFTAG_YRESOLUTION, resolution);
+
+		if (strips_write(&l->strips, image) != 0
+		    || !TIFFWriteDirectory(image))
+			p->error = 1;
+	}
+
+	return p->error ? -1 : 0;
+}
+
+/* write the current page and its pyramid, if any. pyr is freed. */
+static int
+tiff_write_page(TIFF *image, struct pyramid *pyr)
+{
+	int err = 0;
+
+	if (pyr) {
+		uint64_t offsets[PYRAMID_MAX_LEVELS];
+
+		memset(offsets, 0x00, sizeof(offsets));
+		TIFFSetField(image, TIFFTAG_SUBIFD, (uint16_t) pyr->nlevels,
+			     offsets);
+	}
+
+	if (!TIFFWriteDirectory(image))
+		err = -1;
+
+	if (pyr) {
+		if (err == 0 && pyramid_write(pyr, image) != 0) {
+			printf("cannot write reduced resolution levels\n");
+			err = -1;
+		}
+
+		pyramid_free(pyr);
+	}
+
+	return err;
+}
+
+/* hand complete scanlines over to the encoder */
+static int
+scan_put_rows(TIFF *image, struct strips *strips, struct pyramid *pyr,
+	      const SANE_Parameters *parm, SANE_Byte *p, int lines, int *row)
+{
+	/* PNM and PAM frames take the scanlines as they are */
+	if (stream_format >= STREAM_PNM)
+		return stream_put_rows(image, parm, p, lines);
+
+	/* before TIFFWriteScanline(), which may swap the samples in place */
+	if (pyr)
+		pyramid_put_rows(pyr, p, lines);
+
+	if (strips->active) {
+
+		if (strips_put(strips, p, lines) != 0)
+			return -1;
+
+	} else {
+		SANE_Byte *line = p;
+		int i;
+
+		/* Write each scanline */
+		for (i = 0; i < lines; i++) {
+			TIFFWriteScanline(image, line, (*row)++,
+					  strips->sample);
+			line += parm->bytes_per_line;
+		}
+	}
+
+	return 0;
+}
+
+/* XXX planes.c */
+
+/* Three-pass scanners send the red, green and blue planes as separate
+ * frames. By default each plane goes to its own strips of a
+ * PLANARCONFIG_SEPARATE image as it arrives, so nothing more than a strip
+ * is held in memory. With --interleave, or when the height or the output
+ * format calls for contiguous samples, the planes that come first are
+ * spilled to unlinked temporary files and mapped back while the last one
+ * arrives, to be interleaved into RGB scanlines.
+ */
+
+#define PLANES_BATCH 64		/* interleaved rows handed over at once */
+
+struct planes {
+	int active;		/* three-pass scan */
+	int separate;		/* PLANARCONFIG_SEPARATE output */
+	SANE_Parameters frame;	/* layout of a single frame */
+	SANE_Parameters image;	/* and of the whole image */
+
+	int cur;		/* plane of the current frame */
+	int seen;		/* mask of the planes received */
+	int last;		/* the current frame is the last one */
+	uint32_t rows;		/* of the current frame */
+
+	int fd[3];		/* spilled planes */
+	uint32_t spilled[3];
+	unsigned char *map[3];
+	size_t map_size[3];
+
+	unsigned char *blank;	/* a plane row of zeros */
+	unsigned char *out;	/* interleaved rows */
+};
+
+static int
+frame_plane(SANE_Frame format)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch"
+	switch (format) {
+	case SANE_FRAME_RED:
+		return 0;
+	case SANE_FRAME_GREEN:
+		return 1;
+	case SANE_FRAME_BLUE:
+		return 2;
+	default:
+		return -1;
+	}
+#pragma GCC diagnostic pop
+}
+
+static void
+planes_free(struct planes *p)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (p->map[i])
+			munmap(p->map[i], p->map_size[i]);
+		if (p->fd[i] >= 0)
+			close(p->fd[i]);
+
+		p->map[i] = NULL;
+		p->fd[i] = -1;
+	}
+
+	free(p->blank);
+	free(p->out);
+	p->blank = NULL;
+	p->out = NULL;
+}
+
+/* parm is the first frame of the image */
+static int
+planes_init(struct planes *p, const SANE_Parameters *parm)
+{
+	int i;
+
+	memset(p, 0x00, sizeof(*p));
+
+	for (i = 0; i < 3; i++)
+		p->fd[i] = -1;
+
+	p->frame = *parm;
+	p->image = *parm;
+
+	if (frame_plane(parm->format) < 0)
+		return 0;
+
+	p->active = 1;
+	p->frame.format = SANE_FRAME_GRAY;
+	p->image.format = SANE_FRAME_RGB;
+	p->image.bytes_per_line = 3 * parm->bytes_per_line;
+	p->image.last_frame = SANE_TRUE;
+
+	/* PDF, JPEG, PNM and the reduced resolution levels want contiguous
+	 * samples
+	 */
+	p->separate = !interleave && !pdf_mode && !pyramid && parm->lines > 0
+		&& stream_format < STREAM_PNM;
+	if (tiff_codec == COMPRESSION_JPEG)
+		p->separate = 0;
+
+	if (verbose && !p->separate && !interleave && parm->lines <= 0)
+		printf("image height is not known, interleaving the planes\n");
+	else if (verbose > 1)
+		printf("three-pass scan, %s the planes\n",
+		       p->separate ? "separating" : "interleaving");
+
+	p->blank = calloc(1, parm->bytes_per_line);
+	if (!p->separate)
+		p->out = malloc((size_t) PLANES_BATCH
+				* p->image.bytes_per_line);
+
+	if (p->blank == NULL || (!p->separate && p->out == NULL)) {
+		printf("out of memory\n");
+		planes_free(p);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* an unlinked file in TMPDIR, gone once closed and unmapped */
+static int
+scratch_open(void)
+{
+	const char *dir = getenv("TMPDIR");
+	char *name = NULL;
+	int fd;
+
+	strext(&name, dir ? dir : "/tmp");
+	strext(&name, "/tiffscan.XXXXXX");
+
+	fd = mkstemp(name);
+	if (fd < 0) {
+		printf("cannot create a file in %s: %s\n", dir ? dir : "/tmp",
+		       strerror(errno));
+		free(name);
+		return -1;
+	}
+
+	unlink(name);
+	free(name);
+
+	return fd;
+}
+
+static int
+scratch_write(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0)
+			return -1;
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+planes_spill_open(struct planes *p)
+{
+	p->fd[p->cur] = scratch_open();
+
+	return p->fd[p->cur] < 0 ? -1 : 0;
+}
+
+static int
+planes_spill(struct planes *p, const SANE_Byte *data, int lines)
+{
+	if (scratch_write(p->fd[p->cur], data, (size_t) lines
+			  * p->frame.bytes_per_line) != 0) {
+		printf("cannot spill the %s plane: %s\n",
+		       format2name(SANE_FRAME_RED + p->cur), strerror(errno));
+		return -1;
+	}
+
+	p->spilled[p->cur] += lines;
+	p->rows += lines;
+
+	return 0;
+}
+
+/* map whatever was spilled, the files go away with their mappings */
+static int
+planes_map(struct planes *p)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (p->fd[i] < 0)
+			continue;
+
+		p->map_size[i] = (size_t) p->spilled[i]
+			* p->frame.bytes_per_line;
+
+		if (p->map_size[i]) {
+			p->map[i] = mmap(NULL, p->map_size[i], PROT_READ,
+					 MAP_SHARED, p->fd[i], 0);
+			if (p->map[i] == MAP_FAILED) {
+				printf("cannot map the %s plane: %s\n",
+				       format2name(SANE_FRAME_RED + i),
+				       strerror(errno));
+				p->map[i] = NULL;
+				return -1;
+			}
+
+			madvise(p->map[i], p->map_size[i], MADV_SEQUENTIAL);
+		}
+
+		close(p->fd[i]);
+		p->fd[i] = -1;
+	}
+
+	return 0;
+}
+
+/* parm is the frame that has just been started */
+static int
+planes_frame(struct planes *p, const SANE_Parameters *parm)
+{
+	int plane = frame_plane(parm->format);
+
+	if (plane < 0 || parm->depth != p->frame.depth
+	    || parm->pixels_per_line != p->frame.pixels_per_line
+	    || parm->bytes_per_line != p->frame.bytes_per_line) {
+		printf("the %s frame does not match the previous ones\n",
+		       format2name(parm->format));
+		return -1;
+	}
+
+	if (p->seen & (1 << plane)) {
+		printf("got the %s frame twice\n", format2name(parm->format));
+		return -1;
+	}
+
+	p->cur = plane;
+	p->seen |= 1 << plane;
+	p->last = parm->last_frame;
+	p->rows = 0;
+
+	if (p->separate)
+		return 0;
+
+	return p->last ? planes_map(p) : planes_spill_open(p);
+}
+
+/* a row of plane k, data being the current frame */
+static const unsigned char *
+planes_row(const struct planes *p, int k, uint32_t row,
+	   const unsigned char *data)
+{
+	if (k == p->cur)
+		return data ? data : p->blank;
+
+	if (p->map[k] && row < p->spilled[k])
+		return p->map[k] + (size_t) row * p->frame.bytes_per_line;
+
+	return p->blank;
+}
+
+static int
+planes_interleave(struct planes *p, TIFF *image, struct strips *strips,
+		  struct pyramid *pyr, const SANE_Byte *data, int lines,
+		  int *row)
+{
+	int bpl = p->frame.bytes_per_line;
+
+	while (lines > 0) {
+		int n = lines < PLANES_BATCH ? lines : PLANES_BATCH;
+		int i;
+
+		for (i = 0; i < n; i++) {
+			const unsigned char *cur = data ? data + (size_t) i * bpl
+				: NULL;
+
+			interleave3(p->out + (size_t) i * p->image.bytes_per_line,
+				    planes_row(p, 0, p->rows + i, cur),
+				    planes_row(p, 1, p->rows + i, cur),
+				    planes_row(p, 2, p->rows + i, cur), bpl);
+		}
+
+		if (scan_put_rows(image, strips, pyr, &p->image, p->out, n,
+				  row) != 0)
+			return -1;
+
+		p->rows += n;
+		if (data)
+			data += (size_t) n * bpl;
+		lines -= n;
+	}
+
+	return 0;
+}
+
+/* hand the scanlines of the current frame over */
+static int
+planes_put_rows(struct planes *p, TIFF *image, struct strips *strips,
+		struct pyramid *pyr, SANE_Byte *data, int lines, int *row)
+{
+	if (!p->active)
+		return scan_put_rows(image, strips, pyr, &p->frame, data,
+				     lines, row);
+
+	if (p->separate) {
+		/* anything past the announced height is dropped */
+		if (p->rows + lines > (uint32_t) p->frame.lines)
+			lines = p->frame.lines - p->rows;
+
+		p->rows += lines;
+
+		return lines > 0 ? scan_put_rows(image, strips, NULL, &p->frame,
+						 data, lines, row) : 0;
+	}
+
+	if (!p->last)
+		return planes_spill(p, data, lines);
+
+	return planes_interleave(p, image, strips, pyr, data, lines, row);
+}
+
+/* the strips of the current plane of a separate image */
+static void
+planes_strips_init(struct planes *p, struct strips *s, TIFF *image)
+{
+	int rows = tiff_rows_per_strip(&p->image);
+	int tiles = tiff_tiled(&p->image);
+
+	strips_init(s, image, &p->frame, rows, tiles);
+
+	s->planar = 1;
+	s->sample = p->cur;
+	s->index = p->cur * (s->tiled ? s->tiles_across * s->bands
+			     : (p->frame.lines + rows - 1) / rows);
+}
+
+/* complete the current plane with blank rows and write its strips */
+static int
+planes_strips_finish(struct planes *p, TIFF *image, struct strips *s,
+		     int *row)
+{
+	int err = 0;
+
+	if (!s->tiled) {
+		while (p->rows < (uint32_t) p->frame.lines && !err) {
+			err = scan_put_rows(image, s, NULL, &p->frame,
+					    p->blank, 1, row);
+			p->rows++;
+		}
+	}
+
+	if (strips_finish(s) != 0)
+		err = -1;
+
+	return err;
+}
+
+/* after the last frame, or when the scanner gave up early: blank planes
+ * for the frames that never came, the rest of the spilled rows otherwise
+ */
+static int
+planes_finish(struct planes *p, TIFF *image, struct strips *s,
+	      struct pyramid *pyr, int *row)
+{
+	uint32_t rows = 0;
+	int k, err = 0;
+
+	if (p->separate) {
+		for (k = 0; k < 3 && !err; k++) {
+			if (p->seen & (1 << k))
+				continue;
+
+			p->cur = k;
+			p->rows = 0;
+			*row = 0;
+
+			planes_strips_init(p, s, image);
+			err = planes_strips_finish(p, image, s, row);
+		}
+
+		return err;
+	}
+
+	if (planes_map(p) != 0)
+		return -1;
+
+	for (k = 0; k < 3; k++)
+		if (p->spilled[k] > rows)
+			rows = p->spilled[k];
+
+	if (!p->last) {
+		/* the current plane was spilled too */
+		p->cur = -1;
+		p->rows = 0;
+	}
+
+	if (p->rows >= rows)
+		return 0;
+
+	return planes_interleave(p, image, s, pyr, NULL, rows - p->rows, row);
+}
+
+/* XXX geometry.c */
+
+/* --deskew and --autocrop need the whole page: it is spooled to a scratch
+ * file as it arrives and mapped back once scanned. The skew is the angle
+ * at which the lower edges of the dark strokes of a copy of the page,
+ * reduced to about GEOMETRY_MAP pixels, line up best in a projection
+ * profile. The content ends where the rows and columns of the
+ * straightened copy become all dark, scanner background, or all light,
+ * margins. The page is then rotated, nearest neighbour, and cropped on
+ * its way to the encoder.
+ */
+
+#define GEOMETRY_MAP		1024	/* reduced page size */
+#define GEOMETRY_MAX_SKEW	5.0	/* degrees */
+#define GEOMETRY_BATCH		64	/* rows handed over at once */
+#define GEOMETRY_POINTS		(1 << 22) /* edges the skew is measured on */
+
+struct geometry {
+	int active;
+	SANE_Parameters in;	/* the spooled page */
+	SANE_Parameters out;	/* straightened and cropped */
+	int bpp;		/* bytes per pixel, 0 for bilevel pages */
+
+	int fd;
+	unsigned char *map;
+	size_t map_size;
+
+	int scale;		/* page pixels per reduced pixel */
+	int mw, mh;
+	uint8_t *small;		/* brightness of the reduced page */
+	int threshold;		/* anything darker is ink */
+
+	double angle;		/* radians, clockwise */
+	double ca, sa;		/* its cosine and sine */
+	int left, top;		/* of the crop, in the straightened page */
+};
+
+static void
+geometry_free(struct geometry *g)
+{
+	if (g->map)
+		munmap(g->map, g->map_size);
+	if (g->fd >= 0)
+		close(g->fd);
+
+	free(g->small);
+
+	g->map = NULL;
+	g->fd = -1;
+	g->small = NULL;
+}
+
+/* parm is the layout of the rows to be spooled */
+static int
+geometry_start(struct geometry *g, const SANE_Parameters *parm)
+{
+	memset(g, 0x00, sizeof(*g));
+
+	g->fd = -1;
+	g->in = *parm;
+	g->out = *parm;
+
+	if (!deskew && !autocrop)
+		return 0;
+
+	if (frame_plane(parm->format) >= 0) {
+		printf("three-pass scans are not deskewed or cropped\n");
+		return 0;
+	}
+
+	g->fd = scratch_open();
+	if (g->fd < 0)
+		return -1;
+
+	g->active = 1;
+	g->in.lines = 0;
+	g->bpp = parm->depth == 1 ? 0
+		: parm->bytes_per_line / parm->pixels_per_line;
+
+	return 0;
+}
+
+static int
+geometry_put_rows(struct geometry *g, struct stats *st,
+		  const SANE_Byte *data, int lines)
+{
+	double t0 = stats_clock();
+
+	if (scratch_write(g->fd, data, (size_t) lines
+			  * g->in.bytes_per_line) != 0) {
+		printf("cannot spool the page: %s\n", strerror(errno));
+		return -1;
+	}
+
+	g->in.lines += lines;
+	st->spool_time += stats_clock() - t0;
+
+	return 0;
+}
+
+/* brightness of a pixel of the page, 0 to 255 */
+static int
+geometry_pixel(const struct geometry *g, const unsigned char *row, int x)
+{
+	const unsigned char *p = row + (size_t) x * g->bpp;
+
+	if (g->in.depth == 1)
+		return row[x / 8] & (0x80 >> (x % 8)) ? 0 : 255;
+
+	if (g->in.depth == 16) {
+		if (g->bpp < 6)
+			return load16(p) >> 8;
+		return ((load16(p) >> 8) + (load16(p + 2) >> 8)
+			+ (load16(p + 4) >> 8)) / 3;
+	}
+
+	if (g->bpp < 3)
+		return p[0];
+	return (p[0] + p[1] + p[2]) / 3;
+}
+
+/* box filtered copy of the page, with the ink threshold (Otsu) */
+static int
+geometry_reduce(struct geometry *g)
+{
+	int w = g->in.pixels_per_line, h = g->in.lines;
+	int size = w > h ? w : h;
+	uint32_t *acc, hist[256];
+	uint64_t sum = 0, sum_dark = 0, n_dark = 0, total;
+	double best = 0;
+	int x, y, t;
+
+	g->scale = (size + GEOMETRY_MAP - 1) / GEOMETRY_MAP;
+	g->mw = (w + g->scale - 1) / g->scale;
+	g->mh = (h + g->scale - 1) / g->scale;
+
+	g->small = malloc((size_t) g->mw * g->mh);
+	acc = calloc(g->mw, sizeof(*acc));
+	if (g->small == NULL || acc == NULL) {
+		printf("out of memory\n");
+		free(acc);
+		return -1;
+	}
+
+	memset(hist, 0x00, sizeof(hist));
+
+	for (y = 0; y < h; y++) {
+		const unsigned char *row = g->map
+			+ (size_t) y * g->in.bytes_per_line;
+		int rows = y % g->scale + 1;
+
+		for (x = 0; x < w; x++)
+			acc[x / g->scale] += geometry_pixel(g, row, x);
+
+		if (rows < g->scale && y < h - 1)
+			continue;
+
+		for (x = 0; x < g->mw; x++) {
+			int cols = w - x * g->scale;
+			uint8_t v;
+
+			if (cols > g->scale)
+				cols = g->scale;
+
+			v = acc[x] / (rows * cols);
+			g->small[(size_t) (y / g->scale) * g->mw + x] = v;
+			hist[v]++;
+			acc[x] = 0;
+		}
+	}
+
+	free(acc);
+
+	total = (uint64_t) g->mw * g->mh;
+	for (t = 0; t < 256; t++)
+		sum += (uint64_t) t * hist[t];
+
+	/* nothing is ink on a uniform page */
+	g->threshold = 0;
+
+	for (t = 0; t < 255; t++) {
+		double m0, m1, between;
+
+		n_dark += hist[t];
+		sum_dark += (uint64_t) t * hist[t];
+
+		if (n_dark == 0 || n_dark == total)
+			continue;
+
+		m0 = (double) sum_dark / n_dark;
+		m1 = (double) (sum - sum_dark) / (total - n_dark);
+		between = (double) n_dark * (total - n_dark)
+			* (m1 - m0) * (m1 - m0);
+
+		if (between > best) {
+			best = between;
+			g->threshold = t + 1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+geometry_ink(const struct geometry *g, int x, int y)
+{
+	return g->small[(size_t) y * g->mw + x] < g->threshold;
+}
+
+/* How well the points line up along rows sheared by tan(a). Each one is
+ * shared by the two closest rows, which keeps fractions of a reduced
+ * pixel, and so of a degree, apart.
+ */
+static double
+geometry_score(const float *points, int n, double a, double *bins,
+	       int nbins, int offset)
+{
+	double t = tan(a), score = 0;
+	int i;
+
+	memset(bins, 0x00, nbins * sizeof(*bins));
+
+	for (i = 0; i < n; i++) {
+		const float *p = points + 3 * i;
+		double y = p[1] - p[0] * t + offset;
+		int k = floor(y);
+
+		bins[k] += p[2] * (k + 1 - y);
+		bins[k + 1] += p[2] * (y - k);
+	}
+
+	for (i = 0; i < nbins; i++)
+		score += bins[i] * bins[i];
+
+	return score;
+}
+
+/* The lower edges of the strokes, where text lines are straightest,
+ * weighted by their contrast, on the reduced page or on the page itself.
+ * Returns their number, 0 if there are too many.
+ */
+static int
+geometry_edges(const struct geometry *g, int full, float *points, int max)
+{
+	int w = full ? g->in.pixels_per_line : g->mw;
+	int h = full ? g->in.lines : g->mh;
+	int n = 0, x, y;
+
+	for (y = 0; y < h - 1; y++) {
+		const unsigned char *row = g->map
+			+ (size_t) y * g->in.bytes_per_line;
+		const uint8_t *p = g->small + (size_t) y * g->mw;
+
+		for (x = 0; x < w; x++) {
+			int v = full ? geometry_pixel(g, row, x) : p[x];
+			int below = full ? geometry_pixel(g, row
+				+ g->in.bytes_per_line, x) : p[x + g->mw];
+
+			if (v >= g->threshold || below < g->threshold)
+				continue;
+
+			if (n == max)
+				return 0;
+
+			points[3 * n] = x;
+			points[3 * n + 1] = y;
+			points[3 * n + 2] = below - v;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/* the best of the angles center + i * step, i from -steps to steps */
+static int
+geometry_search(struct geometry *g, const float *points, int n, int w,
+		int h, double center, int steps, double step)
+{
+	double max = GEOMETRY_MAX_SKEW * M_PI / 180, best = -1, *bins;
+	int offset = (int) ceil(w * tan(max)) + 1;
+	int nbins = h + 2 * offset + 1;
+	int i;
+
+	bins = malloc(nbins * sizeof(*bins));
+	if (bins == NULL) {
+		printf("out of memory\n");
+		return -1;
+	}
+
+	/* smaller angles win ties, pages are rather straight than not */
+	for (i = 0; i <= 2 * steps; i++) {
+		double a = center + (i % 2 ? -1 : 1) * ((i + 1) / 2) * step;
+		double score;
+
+		if (fabs(a) > max + step / 2)
+			continue;
+
+		score = geometry_score(points, n, a, bins, nbins, offset);
+		if (score > best) {
+			best = score;
+			g->angle = a;
+		}
+	}
+
+	free(bins);
+
+	return 0;
+}
+
+/* tenths of degree on the reduced page, then hundredths and thousandths
+ * on the page
+ */
+static int
+geometry_skew(struct geometry *g)
+{
+	double tenth = M_PI / 180 / 10;
+	size_t max = (size_t) g->mw * g->mh;
+	float *points;
+	int n, err;
+
+	g->angle = 0;
+
+	points = malloc(GEOMETRY_POINTS * 3 * sizeof(*points));
+	if (points == NULL) {
+		printf("out of memory\n");
+		return -1;
+	}
+
+	n = geometry_edges(g, 0, points, max < GEOMETRY_POINTS ? max
+			   : GEOMETRY_POINTS);
+	err = n ? geometry_search(g, points, n, g->mw, g->mh, 0,
+				  GEOMETRY_MAX_SKEW * 10, tenth) : 0;
+
+	if (!err && n && g->scale > 1) {
+		n = geometry_edges(g, 1, points, GEOMETRY_POINTS);
+		if (n)
+			err = geometry_search(g, points, n,
+					      g->in.pixels_per_line,
+					      g->in.lines, g->angle, 10,
+					      tenth / 10);
+		if (n && !err)
+			err = geometry_search(g, points, n,
+					      g->in.pixels_per_line,
+					      g->in.lines, g->angle, 10,
+					      tenth / 100);
+	}
+
+	free(points);
+
+	return err;
+}
+
+/* brightness of the straightened reduced page, -1 outside of it */
+static int
+geometry_small(const struct geometry *g, int x, int y)
+{
+	double cx = g->mw / 2.0, cy = g->mh / 2.0;
+	double dx = x + 0.5 - cx, dy = y + 0.5 - cy;
+	int sx = floor(cx + dx * g->ca - dy * g->sa);
+	int sy = floor(cy + dx * g->sa + dy * g->ca);
+
+	if (sx < 0 || sy < 0 || sx >= g->mw || sy >= g->mh)
+		return -1;
+
+	return g->small[(size_t) sy * g->mw + sx];
+}
+
+/* The rows (columns) of the straightened reduced page from *first to
+ * *last - 1 within lo and hi that are mostly light, paper, or that have
+ * some ink, over the columns (rows) from..to.
+ */
+static void
+geometry_span(const struct geometry *g, int columns, int paper, int lo,
+	      int hi, int from, int to, int *first, int *last)
+{
+	int i, j, found = 0;
+
+	for (i = lo; i < hi; i++) {
+		int dark = 0, in = 0;
+
+		for (j = from; j < to; j++) {
+			int v = columns ? geometry_small(g, i, j)
+				: geometry_small(g, j, i);
+
+			if (v < 0)
+				continue;
+
+			in++;
+			dark += v < g->threshold;
+		}
+
+		if (in == 0 || (paper ? dark * 2 > in : dark * 500 < in))
+			continue;
+
+		if (!found)
+			*first = i;
+		*last = i + 1;
+		found = 1;
+	}
+
+	if (!found) {
+		*first = lo;
+		*last = hi;
+	}
+}
+
+/* the scanner background goes first, then the margins of the paper,
+ * whose edges are left out
+ */
+static void
+geometry_bounds(struct geometry *g, int *right, int *bottom)
+{
+	int l, r, t, b, edge;
+
+	geometry_span(g, 1, 1, 0, g->mw, 0, g->mh, &l, &r);
+	geometry_span(g, 0, 1, 0, g->mh, l, r, &t, &b);
+
+	for (edge = 2; edge > 0; edge--)
+		if (r - l > 2 * edge && b - t > 2 * edge)
+			break;
+
+	geometry_span(g, 1, 0, l + edge, r - edge, t + edge, b - edge,
+		      &l, &r);
+	geometry_span(g, 0, 0, t + edge, b - edge, l, r, &t, &b);
+
+	/* a reduced pixel of margin */
+	l = l > 0 ? l - 1 : 0;
+	t = t > 0 ? t - 1 : 0;
+	r = r < g->mw ? r + 1 : g->mw;
+	b = b < g->mh ? b + 1 : g->mh;
+
+	g->left = l * g->scale;
+	g->top = t * g->scale;
+	*right = r * g->scale;
+	*bottom = b * g->scale;
+
+	if (*right > g->in.pixels_per_line)
+		*right = g->in.pixels_per_line;
+	if (*bottom > g->in.lines)
+		*bottom = g->in.lines;
+}
+
+/* map the spooled page back and find its skew and content */
+static int
+geometry_finish(struct geometry *g)
+{
+	int right = g->in.pixels_per_line, bottom = g->in.lines;
+
+	if (g->in.lines == 0)
+		return 0;
+
+	g->map_size = (size_t) g->in.lines * g->in.bytes_per_line;
+	g->map = mmap(NULL, g->map_size, PROT_READ, MAP_SHARED, g->fd, 0);
+	if (g->map == MAP_FAILED) {
+		printf("cannot map the spooled page: %s\n", strerror(errno));
+		g->map = NULL;
+		return -1;
+	}
+
+	close(g->fd);
+	g->fd = -1;
+
+	if (geometry_reduce(g) != 0)
+		return -1;
+
+	if (deskew && geometry_skew(g) != 0)
+		return -1;
+
+	g->ca = cos(g->angle);
+	g->sa = sin(g->angle);
+
+	if (autocrop)
+		geometry_bounds(g, &right, &bottom);
+
+	g->out = g->in;
+	g->out.pixels_per_line = right - g->left;
+	g->out.lines = bottom - g->top;
+	g->out.bytes_per_line = g->bpp ? g->out.pixels_per_line * g->bpp
+		: (g->out.pixels_per_line + 7) / 8;
+
+	if (verbose)
+		printf("page skewed by %.2f degrees, %dx%d pixels at %d,%d "
+		       "kept\n", g->angle * 180 / M_PI,
+		       g->out.pixels_per_line, g->out.lines, g->left, g->top);
+
+	return 0;
+}
+
+/* rotate and crop the page into the encoder */
+static int
+geometry_write(struct geometry *g, TIFF *image, struct strips *strips,
+	       struct pyramid *pyr, int *row)
+{
+	int w = g->in.pixels_per_line, h = g->in.lines;
+	int obpl = g->out.bytes_per_line;
+	double cx = w / 2.0, cy = h / 2.0;
+	unsigned char *buf;
+	int y, err = 0;
+
+	if (g->out.lines <= 0)
+		return 0;
+
+	buf = malloc((size_t) GEOMETRY_BATCH * obpl);
+	if (buf == NULL) {
+		printf("out of memory\n");
+		return -1;
+	}
+
+	for (y = 0; y < g->out.lines && !err; y += GEOMETRY_BATCH) {
+		int n = g->out.lines - y, i;
+
+		if (n > GEOMETRY_BATCH)
+			n = GEOMETRY_BATCH;
+
+		for (i = 0; i < n; i++) {
+			unsigned char *dst = buf + (size_t) i * obpl;
+			double dx = g->left + 0.5 - cx;
+			double dy = g->top + y + i + 0.5 - cy;
+			double xs = cx + dx * g->ca - dy * g->sa;
+			double ys = cy + dx * g->sa + dy * g->ca;
+			int x;
+
+			/* white where the page was rotated away from */
+			memset(dst, g->bpp ? 0xff : 0x00, obpl);
+
+			for (x = 0; x < g->out.pixels_per_line; x++) {
+				int sx = floor(xs), sy = floor(ys);
+				const unsigned char *src;
+
+				xs += g->ca;
+				ys += g->sa;
+
+				if (sx < 0 || sy < 0 || sx >= w || sy >= h)
+					continue;
+
+				src = g->map + (size_t) sy
+					* g->in.bytes_per_line;
+
+				if (g->bpp)
+					memcpy(dst + (size_t) x * g->bpp,
+					       src + (size_t) sx * g->bpp,
+					       g->bpp);
+				else if (src[sx / 8] & (0x80 >> (sx % 8)))
+					dst[x / 8] |= 0x80 >> (x % 8);
+			}
+		}
+
+		err = scan_put_rows(image, strips, pyr, &g->out, buf, n, row);
+	}
+
+	free(buf);
+
+	return err;
+}
+
+/* on success *pyr holds the reduced resolution levels of the page, if
+ * requested, to be written with tiff_write_page()
+ */
+static SANE_Status
+scan_to_tiff(struct device *dev, TIFF *image, int pageno, int pages,
+	     int resolution, struct pyramid **pyr, struct stats *st)
+{
+	int rows = 0;
+	int tries = 4;
+	int len, hundred_percent = 0;
+
+/* XXX	SANE_Byte min = 0xff, max = 0; */
+	SANE_Parameters parm, out;
+	SANE_Status status;
+	SANE_Word total_bytes = 0, expected_bytes;
+
+	SANE_Byte *buffer;
+	struct ring ring;
+	struct strips strips;
+	struct planes planes;
+	struct binarize bin;
+	struct geometry geom;
+	int fields_set = 0;
+	double t0;
+	SANE_Byte *partial = NULL;	/* a scanline split between two reads */
+	int partial_len = 0;
+	int frame = 0;
+	int lines, err = 0;
+
+	*pyr = NULL;
+
+	memset(st, 0x00, sizeof(*st));
+	st->pageno = pageno;
+	memset(&strips, 0x00, sizeof(strips));
+
+	/* three-pass scanners come back here for every frame */
+next_frame:
+#ifdef SANE_HAS_WARMING_UP
+scan:
+#endif
+	if (tries == 0) {
+		printf("Your scanner must be frozen, will not try again :)\n");
+		status = SANE_STATUS_IO_ERROR;
+		goto done;
+	}
+
+	if (frame == 0)
+		st->start = stats_clock();
+
+	status = source->start(dev->handle);
+
+	/* return immediately when no docs are available */
+	if (status == SANE_STATUS_NO_DOCS && frame == 0)
+		return status;
+
+#ifdef SANE_HAS_WARMING_UP
+	if (status == SANE_STATUS_WARMING_UP) {
+		tries--;
+		printf("The scanner is warming up, will retry in 15 seconds...\n");
+		sleep(15);
+		goto scan;
+	}
+#endif
+	if (status != SANE_STATUS_GOOD) {
+		printf("sane_start: %s\n", sane_strstatus(status));
+
+		/* a page missing its last planes is not the end of the batch */
+		if (status == SANE_STATUS_NO_DOCS)
+			status = SANE_STATUS_IO_ERROR;
+		goto done;
+	}
+
+	status = source->get_parameters(dev->handle, &parm);
+	if (status != SANE_STATUS_GOOD) {
+		printf("sane_get_parameters: %s\n", sane_strstatus(status));
+		goto done;
+	}
+
+	if (verbose) {
+		if (parm.lines >= 0) {
+			printf("scanning %s image of size %dx%d pixels at "
+			       "%d bits/pixel\n",
+			       format2name(parm.format),
+			       parm.pixels_per_line, parm.lines,
+			       8 * parm.bytes_per_line /
+			       parm.pixels_per_line);
+		} else {
+			printf("scanning %s image %d pixels wide and "
+			       "variable height at %d bits/pixel\n",
+			       format2name(parm.format),
+			       parm.pixels_per_line,
+			       8 * parm.bytes_per_line /
+			       parm.pixels_per_line);
+		}
+	}
+
+	/* check format */
+	if (!check_sane_format(&parm)) {
+		status = SANE_STATUS_INVAL;
+		goto done;
+	}
+
+	/* what the samples will look like once converted */
+	convert_parm(&parm, &out);
+
+	if (frame == 0) {
+		if (binarize_start(&bin, &out, resolution) != 0)
+			return SANE_STATUS_NO_MEM;
+
+		if (planes_init(&planes, &bin.parm) != 0) {
+			binarize_free(&bin);
+			return SANE_STATUS_NO_MEM;
+		}
+
+		if (geometry_start(&geom, &bin.parm) != 0) {
+			planes_free(&planes);
+			binarize_free(&bin);
+			return SANE_STATUS_IO_ERROR;
+		}
+
+		/* three frames of one plane each make the image */
+		hundred_percent = parm.bytes_per_line * parm.lines
+			* (planes.active ? 3 : 1);
+
+		partial = malloc(parm.bytes_per_line);
+		if (partial == NULL) {
+			geometry_free(&geom);
+			planes_free(&planes);
+			binarize_free(&bin);
+			return SANE_STATUS_NO_MEM;
+		}
+	} else if (!planes.active) {
+		printf("the %s frame does not belong to a three-pass scan\n",
+		       format2name(parm.format));
+		status = SANE_STATUS_INVAL;
+		goto done;
+	}
+
+	if (planes.active && planes_frame(&planes, &out) != 0) {
+		status = SANE_STATUS_INVAL;
+		goto done;
+	}
+
+	if (verbose > 1) {
+		printf("working on %d buffers of %ld to %ld Kb\n",
+			queue_depth > 0 ? queue_depth : 1,
+			ring_min_size / 1024, ring_max_size / 1024);
+	}
+
+	if (ring_init(&ring, dev->handle, queue_depth, parm.bytes_per_line,
+		      ring_min_size, ring_max_size, st) != 0) {
+		status = SANE_STATUS_NO_MEM;
+		goto done;
+	}
+
+	/* the previous page may still be written, the reader thread
+	 * keeps the scanner busy meanwhile
+	 */
+	page_wait(dev);
+
+	if (planes.separate) {
+		rows = 0;
+		planes_strips_init(&planes, &strips, image);
+	} else if (frame == 0 && !geom.active) {
+		strips_init(&strips, image, &planes.image,
+			    tiff_rows_per_strip(&planes.image),
+			    tiff_tiled(&planes.image));
+
+		*pyr = pyramid ? pyramid_create(&planes.image, resolution)
+			: NULL;
+	}
+
+	while (1) {
+		struct ring_slot *slot;
+		double progr;
+
+		/* read from SANE, through the reader thread */
+		status = ring_get(&ring, &slot);
+		if (status == SANE_STATUS_EOF)
+			break;
+
+		if (status != SANE_STATUS_GOOD) {
+			if (verbose) {
+				printf("sane_read: %s\n", sane_strstatus(status));
+			}
+			break;
+		}
+
+		buffer = slot->data;
+		len = slot->len;
+
+		t0 = stats_clock();
+
+		/* got some data, prepare tiff directory */
+		if (!fields_set) {
+
+			fields_set = 1;
+
+			/* a deskewed or cropped page has its own size */
+			if (!geom.active)
+				tiff_set_fields(image, &planes.image,
+						resolution);
+			tiff_set_user_fields(image);
+			tiff_set_hostcomputer(image);
+
+			/* the planes follow each other, the height is fixed */
+			if (planes.separate) {
+				TIFFSetField(image, TIFFTAG_PLANARCONFIG,
+					     PLANARCONFIG_SEPARATE);
+				TIFFSetField(image, TIFFTAG_IMAGELENGTH,
+					     planes.image.lines);
+			}
+
+			if (pageno && batch) {
+				TIFFSetField(image, TIFFTAG_PAGENUMBER, pageno, pages);
+			}
+		}
+
+		total_bytes += (SANE_Word) len;
+		progr = ((total_bytes * 100.) / (double) hundred_percent);
+		if (progr > 100.)
+			progr = 100.;
+		if (progress)
+			printf("progress: %3.1f%%\r", progr);
+
+		/* complete the scanline left over by the previous read */
+		if (partial_len) {
+			int n = parm.bytes_per_line - partial_len;
+
+			if (n > len)
+				n = len;
+
+			memcpy(partial + partial_len, buffer, n);
+			partial_len += n;
+			buffer += n;
+			len -= n;
+
+			if (partial_len == parm.bytes_per_line) {
+				partial_len = 0;
+				lines = 1;
+				convert_rows(&parm, partial, lines);
+				if (bin.active)
+					lines = binarize_rows(&bin, partial,
+							      lines);
+				if (skip_blank > 0)
+					blank_put_rows(st, &planes.frame,
+						       partial, lines);
+				err = geom.active ? geometry_put_rows(&geom,
+					st, partial, lines)
+					: planes_put_rows(&planes, image,
+							  &strips, *pyr,
+							  partial, lines,
+							  &rows);
+			}
+		}
+
+		/* whole scanlines are encoded from the ring buffer */
+		lines = len / parm.bytes_per_line;
+		if (!err && lines) {
+			convert_rows(&parm, buffer, lines);
+			if (bin.active)
+				lines = binarize_rows(&bin, buffer, lines);
+			if (skip_blank > 0)
+				blank_put_rows(st, &planes.frame, buffer,
+					       lines);
+			err = geom.active ? geometry_put_rows(&geom, st,
+							      buffer, lines)
+				: planes_put_rows(&planes, image, &strips,
+						  *pyr, buffer, lines, &rows);
+		}
+
+		/* keep the start of a straddling scanline */
+		if (len % parm.bytes_per_line) {
+			partial_len = len % parm.bytes_per_line;
+			memcpy(partial, buffer + len - partial_len,
+			       partial_len);
+		}
+
+		st->encode_time += stats_clock() - t0;
+
+		if (err) {
+			status = SANE_STATUS_IO_ERROR;
+			ring_put(&ring);
+			ring_abort(&ring);
+			break;
+		}
+
+		ring_put(&ring);
+	}
+
+	ring_finish(&ring);
+
+	if (partial_len && status == SANE_STATUS_EOF)
+		printf("WARNING: discarding an incomplete scanline of %d "
+		       "bytes at the end of the %s\n", partial_len,
+		       planes.active ? "frame" : "image");
+
+	partial_len = 0;
+
+	/* each plane of a separate image has strips of its own */
+	if (planes.separate) {
+		t0 = stats_clock();
+
+		if (fields_set && status == SANE_STATUS_EOF
+		    && planes_strips_finish(&planes, image, &strips,
+					    &rows) != 0) {
+			printf("cannot write strips to %s\n",
+			       TIFFFileName(image));
+			status = SANE_STATUS_IO_ERROR;
+		}
+
+		if (!fields_set || status != SANE_STATUS_EOF)
+			strips_free(&strips);
+
+		st->encode_time += stats_clock() - t0;
+	}
+
+	if (status == SANE_STATUS_EOF && !parm.last_frame) {
+		frame++;
+		goto next_frame;
+	}
+
+done:
+	if (frame == 0 && partial == NULL)
+		return status;
+
+	free(partial);
+
+	t0 = stats_clock();
+
+	/* the last rows of a binarized page wait for the end of it */
+	if (fields_set && bin.active && status == SANE_STATUS_EOF) {
+		SANE_Byte *tail;
+
+		lines = binarize_finish(&bin, &tail);
+		if (skip_blank > 0)
+			blank_put_rows(st, &planes.frame, tail, lines);
+		if ((geom.active ? geometry_put_rows(&geom, st, tail, lines)
+		     : planes_put_rows(&planes, image, &strips, *pyr, tail,
+				       lines, &rows)) != 0)
+			status = SANE_STATUS_IO_ERROR;
+	}
+
+	binarize_free(&bin);
+
+	/* the whole page is there, straighten and crop it */
+	if (fields_set && geom.active && status == SANE_STATUS_EOF) {
+		double t1 = stats_clock();
+
+		if (geometry_finish(&geom) != 0) {
+			status = SANE_STATUS_IO_ERROR;
+		} else {
+			st->skew = geom.angle * 180 / M_PI;
+			st->detect_time = stats_clock() - t1;
+			t1 = stats_clock();
+
+			tiff_set_fields(image, &geom.out, resolution);
+			strips_init(&strips, image, &geom.out,
+				    tiff_rows_per_strip(&geom.out),
+				    tiff_tiled(&geom.out));
+
+			*pyr = pyramid ? pyramid_create(&geom.out, resolution)
+				: NULL;
+
+			if (geometry_write(&geom, image, &strips, *pyr,
+					   &rows) != 0)
+				status = SANE_STATUS_IO_ERROR;
+
+			st->transform_time = stats_clock() - t1;
+		}
+	}
+
+	geometry_free(&geom);
+
+	if (fields_set && planes.active && status == SANE_STATUS_EOF
+	    && planes_finish(&planes, image, &strips, *pyr, &rows) != 0) {
+		printf("cannot complete the planes of %s\n",
+		       TIFFFileName(image));
+		status = SANE_STATUS_IO_ERROR;
+	}
+
+	planes_free(&planes);
+
+	if (!planes.separate && strips_finish(&strips) != 0) {
+		printf("cannot write strips to %s\n", TIFFFileName(image));
+		status = SANE_STATUS_IO_ERROR;
+	}
+
+	if (*pyr && pyramid_finish(*pyr) != 0) {
+		printf("cannot build reduced resolution levels\n");
+		status = SANE_STATUS_IO_ERROR;
+	}
+
+	st->end = stats_clock();
+	st->encode_time += st->end - t0;
+	st->rows = total_bytes / parm.bytes_per_line / (planes.active ? 3 : 1);
+	st->raw_bytes = total_bytes;
+
+	expected_bytes = parm.bytes_per_line * parm.lines
+		* (planes.active ? 3 : 1);
+
+	if (parm.lines < 0)
+		expected_bytes = 0;
+
+	if (total_bytes > expected_bytes && expected_bytes != 0) {
+		printf("WARNING: read more data than announced by backend "
+		       "(%u/%u)\n", total_bytes, expected_bytes);
+	} else if (verbose > 1)
+		printf("read %u bytes in total\n", total_bytes);
+
+	return status;
+}
+
+static int
+get_resolution(struct device *dev)
+{
+	const SANE_Option_Descriptor *resopt;
+	int resol = 0;
+	void *val;
+
+	if (source == &synthetic_source)
+		return SYNTHETIC_RESOLUTION;
+	if (source == &replay_source)
+		return ((struct replay *) dev->handle)->resolution;
+
+	if (dev->resolution_optind < 0)
+		return 0;
+
+	resopt = sane_get_option_descriptor(dev->handle,
+					    dev->resolution_optind);
+	if (!resopt)
+		return 0;
+
+	val = malloc(resopt->size);
+	if (val == NULL)
+		return 0;
+
+	sane_control_option(dev->handle, dev->resolution_optind,
+			    SANE_ACTION_GET_VALUE, val, 0);
+	if (resopt->type == SANE_TYPE_INT)
+		resol = *(SANE_Int *) val;
+	else
+		resol = (int) (SANE_UNFIX(*(SANE_Fixed *) val) + 0.5);
+
+	free(val);
+
+	return resol;
+}
+
+static void
+tiffscan_exit(void)
+{
+	if (pool)
+		pool_destroy(pool);
+
+	free(convert_lut);
+
+	devices_free();
+
+	sane_exit();
+
+	paperdone();
+
+	if (verbose)
+		printf("done.\n");
+}
+
+static void
+list_devices(void)
+{
+	int i;
+	const SANE_Device **device_list;
+	SANE_Status status;
+
+	status = cache_get_devices(&device_list);
+	if (status != SANE_STATUS_GOOD) {
+		printf("sane_get_devices() failed: %s\n",
+		       sane_strstatus(status));
+		return;
+	}
+
+	for (i = 0; device_list[i]; i++) {
+		printf("device '%s' is a %s %s %s\n",
+		       device_list[i]->name,
+		       device_list[i]->vendor,
+		       device_list[i]->model, device_list[i]->type);
+	}
+
+	if (i == 0) {
+		printf("\nNo scanners were identified. If you were expecting "
+		       "something different,\ncheck that the scanner is plugged "
+		       "in, turned on and detected by the\nsane-find-scanner tool "
+		       "(if appropriate). Please read the documentation\nwhich came "
+		       "SANE (README, FAQ, manpages).\n");
+	}
+}
+
+/* caller must free the returned string */
+
+static char *
+find_suitable_device(void)
+{
+	const SANE_Device **device_list;
+	SANE_Status status;
+
+	char *s = getenv("SANE_DEFAULT_DEVICE");
+	if (s)
+		return strdup(s);
+
+	status = cache_get_devices(&device_list);
+	if (status != SANE_STATUS_GOOD) {
+		printf("sane_get_devices() failed: %s\n",
+		       sane_strstatus(status));
+		return NULL;
+	}
+
+	if (!device_list[0]) {
+		printf("no SANE devices found\n");
+		return NULL;
+	}
+
+	return strdup(device_list[0]->name);
+}
+
+/* bytes of a file as announced by the scanner, 0 if unknown. compression
+ * is not accounted for.
+ */
+static double
+tiff_estimate(SANE_Handle handle)
+{
+	SANE_Parameters parm;
+	double size;
+
+	if (source->get_parameters(handle, &parm) != SANE_STATUS_GOOD)
+		return 0;
+
+	if (parm.lines <= 0)
+		return 0;
+
+	size = (double) parm.bytes_per_line * parm.lines;
+
+	/* the first of three frames */
+	if (frame_plane(parm.format) >= 0)
+		size *= 3;
+
+	if (batch && multi && !stream_format && batch_amount > 0)
+		size *= batch_amount;
+
+	return size;
+}
+
+/* classic TIFF files cannot grow past 4 Gb */
+#define TIFF_BIGTIFF_SIZE	(4.0 * 1024 * 1024 * 1024)
+
+/* XXX tiffio.c */
+
+/* libtiff hands over strips and directories in small writes, each going
+ * through the page cache. With --write-buffer they are gathered in an
+ * aligned buffer and written in large blocks: with --direct-io through
+ * O_DIRECT, otherwise the written ranges are pushed out with
+ * sync_file_range() and dropped from the cache a window later, by a
+ * thread of their own so the scan never waits on the disk. The
+ * estimated size of the file is preallocated and what is left of it
+ * freed when the file is closed.
+ */
+
+#define TIFF_IO_ALIGN	4096
+#define TIFF_IO_WINDOW	(8 * 1024 * 1024)
+
+struct tiff_io {
+	int fd;
+	int dfd;		/* O_DIRECT, or -1 */
+	char *buf;
+	size_t bufsize;
+	size_t len;		/* bytes in buf */
+	uint64_t buf_off;	/* file offset of buf[0] */
+	uint64_t pos;		/* where libtiff is */
+	uint64_t size;		/* of the file, buffered data included */
+	uint64_t alloc;		/* preallocated */
+	uint64_t kick_off;	/* sync_file_range() windows */
+	uint64_t wait_off;
+	uint64_t end;		/* highest offset written */
+};
+
+static int
+tiff_io_pwrite(int fd, const char *buf, size_t len, uint64_t off)
+{
+	while (len) {
+		ssize_t n = pwrite(fd, buf, len, off);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+
+		buf += n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+struct writeback_job {
+	struct job job;		/* must be first */
+	int fd;			/* a dup(), the file may be closed first */
+	uint64_t off;
+	uint64_t len;
+};
+
+static struct pool *writeback_pool;
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+writeback_run(struct job *job)
+{
+	struct writeback_job *wj = (struct writeback_job *) job;
+
+	sync_file_range(wj->fd, wj->off, wj->len,
+			SYNC_FILE_RANGE_WAIT_BEFORE |
+			SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(wj->fd, wj->off, wj->len, POSIX_FADV_DONTNEED);
+
+	close(wj->fd);
+}
+
+/* without memory or a descriptor the range just stays in the cache */
+static void
+writeback_submit(int fd, uint64_t off, uint64_t len)
+{
+	struct writeback_job *wj;
+
+	wj = calloc(1, sizeof(*wj));
+	if (wj == NULL)
+		return;
+
+	wj->fd = dup(fd);
+	if (wj->fd < 0) {
+		free(wj);
+		return;
+	}
+
+	wj->job.run = writeback_run;
+	wj->job.detached = 1;
+	wj->off = off;
+	wj->len = len;
+
+	pthread_mutex_lock(&writeback_lock);
+	if (writeback_pool == NULL)
+		writeback_pool = pool_create(1);
+	pthread_mutex_unlock(&writeback_lock);
+
+	pool_submit(writeback_pool, &wj->job);
+}
+
+/* start writeback of the last window, the writeback thread waits for
+ * the one before and drops it from the cache
+ */
+static void
+tiff_io_writeback(struct tiff_io *io)
+{
+	if (io->end - io->kick_off < TIFF_IO_WINDOW)
+		return;
+
+	if (io->kick_off > io->wait_off)
+		writeback_submit(io->fd, io->wait_off,
+				 io->kick_off - io->wait_off);
+
+	sync_file_range(io->fd, io->kick_off, io->end - io->kick_off,
+			SYNC_FILE_RANGE_WRITE);
+
+	io->wait_off = io->kick_off;
+	io->kick_off = io->end;
+}
+
+/* write the buffer out. with all set, the unaligned tail too, else it
+ * stays in the buffer for the next writes to complete
+ */
+static int
+tiff_io_drain(struct tiff_io *io, int all)
+{
+	size_t n = 0;
+
+	if (io->dfd >= 0 && io->buf_off % TIFF_IO_ALIGN == 0) {
+		n = io->len & ~(size_t) (TIFF_IO_ALIGN - 1);
+		if (n && tiff_io_pwrite(io->dfd, io->buf, n, io->buf_off))
+			return -1;
+	}
+
+	if (io->dfd < 0 || all) {
+		if (tiff_io_pwrite(io->fd, io->buf + n, io->len - n,
+				   io->buf_off + n) != 0)
+			return -1;
+		n = io->len;
+	}
+
+	if (io->buf_off + n > io->end)
+		io->end = io->buf_off + n;
+
+	memmove(io->buf, io->buf + n, io->len - n);
+	io->buf_off += n;
+	io->len -= n;
+
+	if (io->dfd < 0)
+		tiff_io_writeback(io);
+
+	return 0;
+}
+
+/* a new buffer at io->pos. for O_DIRECT it begins on a block, the bytes
+ * before io->pos are read back
+ */
+static int
+tiff_io_begin(struct tiff_io *io)
+{
+	size_t head = 0;
+
+	if (io->dfd >= 0)
+		head = io->pos % TIFF_IO_ALIGN;
+
+	io->buf_off = io->pos - head;
+	io->len = head;
+
+	if (head) {
+		ssize_t n = pread(io->fd, io->buf, head, io->buf_off);
+
+		if (n < 0)
+			return -1;
+		memset(io->buf + n, 0x00, head - n);
+	}
+
+	return 0;
+}
+
+static tmsize_t
+tiff_io_read(thandle_t h, void *buf, tmsize_t size)
+{
+	struct tiff_io *io = (struct tiff_io *) h;
+	ssize_t n;
+
+	if (io->len && tiff_io_drain(io, 1) != 0)
+		return -1;
+
+	n = pread(io->fd, buf, size, io->pos);
+	if (n > 0)
+		io->pos += n;
+
+	return n;
+}
+
+static tmsize_t
+tiff_io_write(thandle_t h, void *buf, tmsize_t size)
+{
+	struct tiff_io *io = (struct tiff_io *) h;
+	const char *p = buf;
+	tmsize_t left = size;
+
+	/* not where the buffered data ends, write that out first */
+	if (io->len && io->pos != io->buf_off + io->len
+	    && tiff_io_drain(io, 1) != 0)
+		return -1;
+
+	if (io->len == 0 && tiff_io_begin(io) != 0)
+		return -1;
+
+	while (left) {
+		size_t n = io->bufsize - io->len;
+
+		if (n > (size_t) left)
+			n = left;
+
+		memcpy(io->buf + io->len, p, n);
+		io->len += n;
+		p += n;
+		left -= n;
+
+		if (io->len == io->bufsize && tiff_io_drain(io, 0) != 0)
+			return -1;
+	}
+
+	io->pos += size;
+	if (io->pos > io->size)
+		io->size = io->pos;
+
+	return size;
+}
+
+static toff_t
+tiff_io_seek(thandle_t h, toff_t off, int whence)
+{
+	struct tiff_io *io = (struct tiff_io *) h;
+
+	if (whence == SEEK_CUR)
+		off += io->pos;
+	else if (whence == SEEK_END)
+		off += io->size;
+
+	io->pos = off;
+
+	return off;
+}
+
+static toff_t
+tiff_io_size(thandle_t h)
+{
+	return ((struct tiff_io *) h)->size;
+}
+
+static int
+tiff_io_map(thandle_t h, void **base, toff_t *size)
+{
+	return 0;
+}
+
+static void
+tiff_io_unmap(thandle_t h, void *base, toff_t size)
+{
+}
+
+static void
+tiff_io_free(struct tiff_io *io)
+{
+	budget_give(io->bufsize);
+
+	if (io->dfd >= 0)
+		close(io->dfd);
+	close(io->fd);
+	free(io->buf);
+	free(io);
+}
+
+static int
+tiff_io_close(thandle_t h)
+{
+	struct tiff_io *io = (struct tiff_io *) h;
+	int err = 0;
+
+	if (io->len && tiff_io_drain(io, 1) != 0)
+		err = -1;
+
+	/* the preallocated blocks past the end */
+	if (io->alloc > io->size)
+		fallocate(io->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  io->size, io->alloc - io->size);
+
+	tiff_io_free(io);
+
+	return err;
+}
+
+/* what is still buffered goes to the file, for those reading it by fd */
+static int
+tiff_io_flush(TIFF *image)
+{
+	struct tiff_io *io = (struct tiff_io *) TIFFClientdata(image);
+
+	if (TIFFGetReadProc(image) != tiff_io_read || io->len == 0)
+		return 0;
+
+	return tiff_io_drain(io, 1);
+}
+
+/* cut the file back to size, nothing past it is referenced any more */
+static int
+tiff_truncate(TIFF *image, uint64_t size)
+{
+	struct tiff_io *io = (struct tiff_io *) TIFFClientdata(image);
+
+	if (TIFFGetReadProc(image) != tiff_io_read)
+		return ftruncate(TIFFFileno(image), size);
+
+	if (io->len && tiff_io_drain(io, 1) != 0)
+		return -1;
+
+	if (ftruncate(io->fd, size) != 0)
+		return -1;
+
+	if (io->size > size)
+		io->size = size;
+	if (io->pos > size)
+		io->pos = size;
+	if (io->end > size)
+		io->end = size;
+	if (io->kick_off > size)
+		io->kick_off = size;
+	if (io->wait_off > size)
+		io->wait_off = size;
+	if (io->alloc > size)
+		io->alloc = size;
+
+	return 0;
+}
+
+/* all the files are closed, let the last windows go */
+static void
+tiff_io_stop(void)
+{
+	if (writeback_pool) {
+		pool_destroy(writeback_pool);
+		writeback_pool = NULL;
+	}
+}
+
+static TIFF *
+tiff_io_open(const char *name, const char *mode, double estimate)
+{
+	struct tiff_io *io;
+	struct stat sb;
+	TIFF *image;
+	int flags = O_RDWR | O_CREAT;
+
+	if (mode[0] == 'w')
+		flags |= O_TRUNC;
+
+	io = calloc(1, sizeof(*io));
+	if (io == NULL)
+		return NULL;
+
+	io->bufsize = (size_t) write_buffer * 1024;
+
+	/* a quarter of the budget at most, the scan needs the rest */
+	if (budget.limit && io->bufsize > budget.limit / 4)
+		io->bufsize = budget.limit / 4;
+
+	io->bufsize = (io->bufsize + TIFF_IO_ALIGN - 1)
+	    & ~(size_t) (TIFF_IO_ALIGN - 1);
+
+	if (posix_memalign((void **) &io->buf, TIFF_IO_ALIGN,
+			   io->bufsize) != 0) {
+		free(io);
+		return NULL;
+	}
+
+	io->fd = open(name, flags | O_CLOEXEC, 0666);
+	if (io->fd < 0 || fstat(io->fd, &sb) != 0) {
+		TIFFErrorExt(0, name, "%s", strerror(errno));
+		if (io->fd >= 0)
+			close(io->fd);
+		free(io->buf);
+		free(io);
+		return NULL;
+	}
+
+	io->size = sb.st_size;
+	io->kick_off = io->wait_off = io->end = io->size;
+	io->dfd = -1;
+
+	/* tmpfs and others refuse it */
+	if (direct_io) {
+		io->dfd = open(name, O_WRONLY | O_DIRECT | O_CLOEXEC);
+		if (io->dfd < 0 && verbose)
+			printf("no direct I/O on %s: %s\n", name,
+			       strerror(errno));
+	}
+
+	if (estimate > io->size && fallocate(io->fd, FALLOC_FL_KEEP_SIZE, 0,
+					     (off_t) estimate) == 0)
+		io->alloc = estimate;
+
+	budget_take(io->bufsize);
+
+	image = TIFFClientOpen(name, mode, (thandle_t) io, tiff_io_read,
+			       tiff_io_write, tiff_io_seek, tiff_io_close,
+			       tiff_io_size, tiff_io_map, tiff_io_unmap);
+	if (image == NULL) {
+		tiff_io_free(io);
+		return NULL;
+	}
+
+	/* for fsync() and the journal */
+	TIFFSetFileno(image, io->fd);
+
+	return image;
+}
+
+/* the file name template with the page number in it */
+static char *
+tiff_file_name(const char *file, int pageno)
+{
+	char *f;
+	int len;
+
+	/* alloc space for file name + formatting */
+	len = strlen(file) * 2;
+
+	f = malloc(len);
+	if (f == NULL)
+		return NULL;
+
+	/* add formatting to the file name */
+	snprintf(f, len, file, pageno);
+
+	return f;
+}
+
+/* append goes on with the pages of a resumed multi-page file */
+static TIFF *
+tiff_open(const char *file, const char *icc, int pageno, double estimate,
+	  int append)
+{
+	TIFF *image;
+	char mode[4];
+	char *f;
+
+	f = tiff_file_name(file, pageno);
+	if (f == NULL)
+		return NULL;
+
+	if (append)
+		strcpy(mode, "a");
+	else
+		snprintf(mode, sizeof(mode), "w%s%s",
+			 estimate >= TIFF_BIGTIFF_SIZE ? "8" : "",
+			 tiff_byte_order());
+
+	if (write_buffer > 0)
+		image = tiff_io_open(f, mode, estimate);
+	else
+		image = TIFFOpen(f, mode);
+
+	free(f);
+
+	/* embed ICC profile */
+	if (image && icc)
+		embed_icc_profile(image, icc);
+
+	return image;
+}
+
+/* XXX stream.c */
+
+/* --stream writes the pages one after the other to a pipe, a FIFO or
+ * the standard output, so that they can be read while the next ones are
+ * scanned. A TIFF page is put together in memory and goes out whole once
+ * the worker has written its directory, TIFF readers seek anyway. PNM and
+ * PAM frames go out a strip at a time as the scanlines arrive, unless the
+ * height of the page is not known or blank pages are to be dropped: the
+ * header needs the height, and a frame on its way cannot be taken back.
+ */
+
+struct stream {
+	struct membuf mb;	/* must be first, the TIFF file */
+	int fd;
+	struct membuf frame;	/* PNM or PAM scanlines not written yet */
+	SANE_Parameters parm;	/* of the frame, once it began */
+	int rows;		/* in the frame so far */
+	int hold;		/* the frame waits for the end of the page */
+	int header;		/* of the frame, written */
+	uint64_t bytes;		/* of the page, written so far */
+};
+
+static int stream_stdout = -1;	/* where the standard output went */
+
+static int
+stream_close(thandle_t h)
+{
+	struct stream *s = h;
+
+	budget_give(s->mb.alloc + s->frame.alloc);
+	free(s->mb.data);
+	free(s->frame.data);
+	free(s);
+
+	return 0;
+}
+
+/* whether image is a page of a stream */
+static int
+stream_page(TIFF *image)
+{
+	return TIFFGetCloseProc(image) == stream_close;
+}
+
+static uint64_t
+stream_bytes(TIFF *image)
+{
+	return ((struct stream *) TIFFClientdata(image))->bytes;
+}
+
+static int
+stream_init(void)
+{
+	stream_format = 0;
+
+	if (stream_name == NULL)
+		return 0;
+
+	if (strcmp(stream_name, "tiff") == 0)
+		stream_format = STREAM_TIFF;
+	else if (strcmp(stream_name, "pnm") == 0)
+		stream_format = STREAM_PNM;
+	else if (strcmp(stream_name, "pam") == 0)
+		stream_format = STREAM_PAM;
+	else {
+		printf("unknown stream format: %s\n", stream_name);
+		return -1;
+	}
+
+	if (pdf_mode || resume) {
+		printf("--pdf and --resume need a file, not a stream\n");
+		return -1;
+	}
+
+	if (stream_format != STREAM_TIFF && (pyramid || tiled)) {
+		printf("--pyramid and --tiled only apply to TIFF streams\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* whatever is printed goes to stderr, stdout is left to the pages */
+static void
+stream_redirect(void)
+{
+	fflush(stdout);
+
+	stream_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+	if (stream_stdout >= 0)
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+}
+
+/* file is - for the standard output */
+static int
+stream_start(struct device *dev, const char *file)
+{
+	if (strcmp(file, "-") != 0) {
+		dev->stream_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC
+				      | O_CLOEXEC, 0666);
+	} else if (stream_stdout < 0) {
+		printf("the standard output carries the messages of a daemon job, stream to a FIFO instead\n");
+		return -1;
+	} else
+		dev->stream_fd = stream_stdout;
+
+	if (dev->stream_fd < 0) {
+		printf("cannot open %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+stream_stop(struct device *dev)
+{
+	if (dev->stream_fd != stream_stdout)
+		close(dev->stream_fd);
+
+	dev->stream_fd = -1;
+}
+
+/* a page of the stream, sent by stream_end() */
+static TIFF *
+stream_open(struct device *dev, const char *file, const char *icc,
+	    double estimate)
+{
+	struct stream *s;
+	char mode[4];
+	TIFF *image;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+
+	s->fd = dev->stream_fd;
+
+	snprintf(mode, sizeof(mode), "w%s%s",
+		 estimate >= TIFF_BIGTIFF_SIZE ? "8" : "", tiff_byte_order());
+
+	image = TIFFClientOpen(strcmp(file, "-") ? file : "standard output",
+			       mode, s, mem_read, mem_write, mem_seek,
+			       stream_close, mem_size, mem_map, mem_unmap);
+	if (image == NULL) {
+		stream_close(s);
+		return NULL;
+	}
+
+	if (icc && stream_format == STREAM_TIFF)
+		embed_icc_profile(image, icc);
+
+	return image;
+}
+
+static int
+stream_write(struct stream *s, const void *data, size_t len)
+{
+	if (scratch_write(s->fd, data, len) != 0) {
+		printf("cannot write the stream: %s\n", strerror(errno));
+		return -1;
+	}
+
+	s->bytes += len;
+
+	return 0;
+}
+
+static int
+stream_samples(const SANE_Parameters *parm)
+{
+	return parm->depth == 1 ? 1 : tiff_samples(parm);
+}
+
+/* bytes of a PNM or PAM scanline, a PAM bilevel pixel takes a byte */
+static size_t
+stream_row_size(const SANE_Parameters *parm)
+{
+	if (parm->depth == 1 && stream_format == STREAM_PAM)
+		return parm->pixels_per_line;
+
+	return ((size_t) parm->pixels_per_line * stream_samples(parm)
+		* parm->depth + 7) / 8;
+}
+
+/* a new scanline at the end of the frame */
+static unsigned char *
+stream_row(struct stream *s)
+{
+	size_t size = stream_row_size(&s->parm);
+
+	if (mem_reserve(&s->frame, s->frame.size + size) != 0)
+		return NULL;
+
+	s->frame.size += size;
+	s->rows++;
+
+	return s->frame.data + s->frame.size - size;
+}
+
+static int
+stream_header(struct stream *s)
+{
+	const SANE_Parameters *parm = &s->parm;
+	const char *type = "RGB";
+	int samples = stream_samples(parm);
+	int height = parm->lines >= 0 ? parm->lines : s->rows;
+	char buf[128];
+	int n;
+
+	if (parm->depth == 1)
+		type = "BLACKANDWHITE";
+	else if (samples == 1)
+		type = "GRAYSCALE";
+	else if (samples == 4)
+		type = "RGB_INFRARED";
+
+	if (stream_format == STREAM_PAM)
+		n = snprintf(buf, sizeof(buf), "P7\nWIDTH %d\nHEIGHT %d\n"
+			     "DEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n",
+			     parm->pixels_per_line, height, samples,
+			     (1 << parm->depth) - 1, type);
+	else if (parm->depth == 1)
+		n = snprintf(buf, sizeof(buf), "P4\n%d %d\n",
+			     parm->pixels_per_line, height);
+	else
+		n = snprintf(buf, sizeof(buf), "P%d\n%d %d\n%d\n",
+			     samples == 1 ? 5 : 6, parm->pixels_per_line,
+			     height, (1 << parm->depth) - 1);
+
+	s->header = 1;
+
+	return stream_write(s, buf, n);
+}
+
+static int
+stream_flush(struct stream *s)
+{
+	if (!s->header && stream_header(s) != 0)
+		return -1;
+
+	if (stream_write(s, s->frame.data, s->frame.size) != 0)
+		return -1;
+
+	s->frame.size = 0;
+
+	return 0;
+}
+
+/* the scanlines of a PNM or PAM frame, in place of the TIFF strips */
+static int
+stream_put_rows(TIFF *image, const SANE_Parameters *parm,
+		const SANE_Byte *p, int lines)
+{
+	struct stream *s = TIFFClientdata(image);
+	size_t size = stream_row_size(parm);
+	int i, x;
+
+	if (s->parm.pixels_per_line == 0) {
+		if (stream_format == STREAM_PNM && stream_samples(parm) > 3) {
+			printf("PNM has no room for the infrared samples, use --stream pam\n");
+			return -1;
+		}
+
+		s->parm = *parm;
+		s->hold = parm->lines < 0 || skip_blank > 0;
+	}
+
+	/* anything past the announced height is dropped */
+	if (parm->lines >= 0 && lines > parm->lines - s->rows)
+		lines = parm->lines - s->rows;
+
+	for (i = 0; i < lines; i++, p += parm->bytes_per_line) {
+		unsigned char *q = stream_row(s);
+
+		if (q == NULL) {
+			printf("out of memory\n");
+			return -1;
+		}
+
+		/* PBM has 1 for black like SANE, PAM has it for white */
+		if (parm->depth == 1 && stream_format == STREAM_PAM) {
+			for (x = 0; x < parm->pixels_per_line; x++)
+				q[x] = !(p[x / 8] & (0x80 >> (x % 8)));
+		} else
+			memcpy(q, p, size);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		if (parm->depth == 16)
+			swap16(q, size / 2);
+#endif
+	}
+
+	if (!s->hold && s->frame.size >= STRIP_AUTO_SIZE)
+		return stream_flush(s);
+
+	return 0;
+}
+
+/* the page is complete, send what is left of it. a frame short of its
+ * height gets zeroed scanlines.
+ */
+static int
+stream_end(TIFF *image)
+{
+	struct stream *s = TIFFClientdata(image);
+
+	if (stream_format == STREAM_TIFF) {
+		if (!TIFFFlush(image))
+			return -1;
+
+		return stream_write(s, s->mb.data, s->mb.size);
+	}
+
+	/* not a single scanline */
+	if (s->parm.pixels_per_line == 0)
+		return 0;
+
+	while (s->rows < s->parm.lines) {
+		unsigned char *q = stream_row(s);
+
+		if (q == NULL) {
+			printf("out of memory\n");
+			return -1;
+		}
+
+		memset(q, 0x00, stream_row_size(&s->parm));
+	}
+
+	return stream_flush(s);
+}
+
+/* XXX pdf.c */
+
+/* A minimal PDF writer. Each strip or tile of a TIFF page becomes an
+ * image XObject holding the compressed data found in the file: Deflate
+ * as FlateDecode, LZW as LZWDecode and G4 as CCITTFaxDecode. Data is
+ * only decoded, and deflated again, when PDF has no matching filter or
+ * when the strips are too short to be worth an image of their own.
+ */
+
+#define PDF_MIN_STRIP_ROWS 16
+
+struct pdf {
+	FILE *fp;
+	long *offsets;		/* by object number */
+	int nobjs;
+	int alloc;
+};
+
+struct pdf_page {
+	uint32_t width, height;
+	uint32_t piece_width;	/* tile size, or width and rows per strip */
+	uint32_t piece_height;
+	uint32_t npieces;
+	int tiled;
+
+	uint16_t bps, spp, compression, photometric;
+	uint16_t predictor, fillorder, planar;
+
+	int colors;		/* samples drawn, extra samples are dropped */
+	float sx, sy;		/* points per pixel */
+};
+
+static int
+pdf_obj_new(struct pdf *pdf)
+{
+	if (pdf->nobjs + 1 >= pdf->alloc) {
+		int alloc = pdf->alloc ? pdf->alloc * 2 : 256;
+		long *offsets = realloc(pdf->offsets, alloc * sizeof(long));
+
+		if (offsets == NULL)
+			return -1;
+
+		pdf->offsets = offsets;
+		pdf->alloc = alloc;
+	}
+
+	pdf->offsets[++pdf->nobjs] = 0;
+
+	return pdf->nobjs;
+}
+
+static void
+pdf_obj_begin(struct pdf *pdf, int obj)
+{
+	pdf->offsets[obj] = ftell(pdf->fp);
+	fprintf(pdf->fp, "%d 0 obj\n", obj);
+}
+
+static void
+pdf_obj_end(struct pdf *pdf)
+{
+	fputs("endobj\n", pdf->fp);
+}
+
+static int
+pdf_embeddable(TIFF *tif, const struct pdf_page *pg)
+{
+	uint32_t count;
+	void *tables;
+
+	if (pg->planar != PLANARCONFIG_CONTIG
+	    || pg->fillorder != FILLORDER_MSB2LSB
+	    || pg->spp != pg->colors)
+		return 0;
+
+	/* PDF wants big endian samples */
+	if (pg->bps == 16 && !TIFFIsBigEndian(tif))
+		return 0;
+
+	if (pg->predictor != PREDICTOR_NONE
+	    && pg->predictor != PREDICTOR_HORIZONTAL)
+		return 0;
+
+	switch (pg->compression) {
+	case COMPRESSION_NONE:
+	case COMPRESSION_DEFLATE:
+	case COMPRESSION_ADOBE_DEFLATE:
+	case COMPRESSION_LZW:
+		return 1;
+
+	case COMPRESSION_CCITTFAX4:
+		return pg->bps == 1;
+
+	/* whole JPEG streams, unless the tables are kept apart */
+	case COMPRESSION_JPEG:
+		return pg->bps == 8
+			&& !TIFFGetField(tif, TIFFTAG_JPEGTABLES, &count,
+					 &tables);
+	}
+
+	return 0;
+}
+
+static void
+pdf_image_dict(struct pdf *pdf, const struct pdf_page *pg,
+	       uint32_t width, uint32_t height, int coded)
+{
+	fprintf(pdf->fp, "<< /Type /XObject /Subtype /Image "
+		"/Width %u /Height %u /ColorSpace /%s /BitsPerComponent %u",
+		width, height, pg->colors == 1 ? "DeviceGray" : "DeviceRGB",
+		pg->bps);
+
+	/* G4 knows black from white by itself */
+	if (pg->photometric == PHOTOMETRIC_MINISWHITE && !coded)
+		fputs(" /Decode [1 0]", pdf->fp);
+}
+
+/* the filter of a strip or tile taken as is from the TIFF file */
+static void
+pdf_filter(struct pdf *pdf, const struct pdf_page *pg,
+	   uint32_t width, uint32_t height)
+{
+	const char *filter = NULL;
+
+	switch (pg->compression) {
+	case COMPRESSION_DEFLATE:
+	case COMPRESSION_ADOBE_DEFLATE:
+		filter = "FlateDecode";
+		break;
+
+	case COMPRESSION_LZW:
+		filter = "LZWDecode";
+		break;
+
+	case COMPRESSION_JPEG:
+		filter = "DCTDecode";
+		break;
+
+	case COMPRESSION_CCITTFAX4:
+		fprintf(pdf->fp, " /Filter /CCITTFaxDecode /DecodeParms "
+			"<< /K -1 /Columns %u /Rows %u%s >>", width, height,
+			pg->photometric == PHOTOMETRIC_MINISBLACK ?
+			" /BlackIs1 true" : "");
+		return;
+	}
+
+	if (filter == NULL)
+		return;
+
+	fprintf(pdf->fp, " /Filter /%s", filter);
+
+	if (pg->predictor == PREDICTOR_HORIZONTAL)
+		fprintf(pdf->fp, " /DecodeParms << /Predictor 2 /Colors %d "
+			"/BitsPerComponent %u /Columns %u >>",
+			pg->spp, pg->bps, width);
+}
+
+static int
+pdf_write_raw(struct pdf *pdf, TIFF *tif, const struct pdf_page *pg,
+	      uint32_t piece, uint32_t width, uint32_t height)
+{
+	uint64_t *counts;
+	unsigned char *buf;
+	tmsize_t len;
+	int obj;
+
+	if (!TIFFGetField(tif, pg->tiled ? TIFFTAG_TILEBYTECOUNTS :
+			  TIFFTAG_STRIPBYTECOUNTS, &counts))
+		return -1;
+
+	buf = malloc(counts[piece] ? counts[piece] : 1);
+	if (buf == NULL)
+		return -1;
+
+	if (pg->tiled)
+		len = TIFFReadRawTile(tif, piece, buf, counts[piece]);
+	else
+		len = TIFFReadRawStrip(tif, piece, buf, counts[piece]);
+
+	obj = pdf_obj_new(pdf);
+
+	if (len < 0 || obj < 0) {
+		free(buf);
+		return -1;
+	}
+
+	pdf_obj_begin(pdf, obj);
+	pdf_image_dict(pdf, pg, width, height,
+		       pg->compression == COMPRESSION_CCITTFAX4);
+	pdf_filter(pdf, pg, width, height);
+	fprintf(pdf->fp, " /Length %ld >>\nstream\n", (long) len);
+	fwrite(buf, 1, len, pdf->fp);
+	fputs("\nendstream\n", pdf->fp);
+	pdf_obj_end(pdf);
+
+	free(buf);
+
+	return obj;
+}
+
+/* decoded samples in place: drop extra samples, make 16 bit big endian */
+static size_t
+pdf_convert(const struct pdf_page *pg, unsigned char *buf, size_t len)
+{
+	size_t bytes = pg->bps / 8;
+	size_t npixels, i;
+
+	if (pg->bps == 1)
+		return len;
+
+	npixels = len / (bytes * pg->spp);
+
+	if (pg->colors != pg->spp) {
+		for (i = 0; i < npixels; i++)
+			memmove(buf + i * pg->colors * bytes,
+				buf + i * pg->spp * bytes,
+				pg->colors * bytes);
+
+		len = npixels * pg->colors * bytes;
+	}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (pg->bps == 16)
+		swap16(buf, len / 2);
+#endif
+
+	return len;
+}
+
+struct pdf_deflate {
+	z_stream z;
+	FILE *fp;
+	long length;
+	unsigned char out[64 * 1024];
+};
+
+static int
+pdf_deflate_put(struct pdf_deflate *pd, unsigned char *data, size_t len,
+		int flush)
+{
+	pd->z.next_in = data;
+	pd->z.avail_in = len;
+
+	do {
+		size_t n;
+		int rc;
+
+		pd->z.next_out = pd->out;
+		pd->z.avail_out = sizeof(pd->out);
+
+		rc = deflate(&pd->z, flush);
+		if (rc == Z_STREAM_ERROR)
+			return -1;
+
+		n = sizeof(pd->out) - pd->z.avail_out;
+		if (fwrite(pd->out, 1, n, pd->fp) != n)
+			return -1;
+
+		pd->length += n;
+	} while (pd->z.avail_out == 0);
+
+	return 0;
+}
+
+/* write a Flate image of width x height pixels, taking decoded data
+ * from the pieces [first, last] of the page
+ */
+static int
+pdf_write_decoded(struct pdf *pdf, TIFF *tif, const struct pdf_page *pg,
+		  uint32_t first, uint32_t last,
+		  uint32_t width, uint32_t height)
+{
+	struct pdf_deflate *pd;
+	unsigned char *buf;
+	tmsize_t size;
+	uint32_t piece;
+	int obj, length_obj, err = 0;
+
+	size = pg->tiled ? TIFFTileSize(tif) : TIFFStripSize(tif);
+
+	buf = malloc(size);
+	pd = calloc(1, sizeof(*pd));
+
+	obj = pdf_obj_new(pdf);
+	length_obj = pdf_obj_new(pdf);
+
+	if (buf == NULL || pd == NULL || obj < 0 || length_obj < 0
+	    || deflateInit(&pd->z, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		free(buf);
+		free(pd);
+		return -1;
+	}
+
+	pd->fp = pdf->fp;
+
+	pdf_obj_begin(pdf, obj);
+	pdf_image_dict(pdf, pg, width, height, 0);
+	fprintf(pdf->fp, " /Filter /FlateDecode /Length %d 0 R >>\nstream\n",
+		length_obj);
+
+	for (piece = first; piece <= last && !err; piece++) {
+		tmsize_t len;
+
+		if (pg->tiled)
+			len = TIFFReadEncodedTile(tif, piece, buf, size);
+		else
+			len = TIFFReadEncodedStrip(tif, piece, buf, size);
+
+		if (len < 0)
+			err = -1;
+		else
+			err = pdf_deflate_put(pd, buf,
+					      pdf_convert(pg, buf, len),
+					      Z_NO_FLUSH);
+	}
+
+	if (!err)
+		err = pdf_deflate_put(pd, NULL, 0, Z_FINISH);
+
+	deflateEnd(&pd->z);
+
+	fputs("\nendstream\n", pdf->fp);
+	pdf_obj_end(pdf);
+
+	pdf_obj_begin(pdf, length_obj);
+	fprintf(pdf->fp, "%ld\n", pd->length);
+	pdf_obj_end(pdf);
+
+	free(buf);
+	free(pd);
+
+	return err ? -1 : obj;
+}
+
+static int
+pdf_page_info(TIFF *tif, struct pdf_page *pg)
+{
+	uint16_t *extra, nextra = 0;
+	float xres = 0, yres = 0;
+
+	memset(pg, 0x00, sizeof(*pg));
+
+	if (!TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &pg->width)
+	    || !TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &pg->height))
+		return -1;
+
+	pg->bps = 1;
+	pg->spp = 1;
+	pg->compression = COMPRESSION_NONE;
+	pg->photometric = PHOTOMETRIC_MINISWHITE;
+	pg->predictor = PREDICTOR_NONE;
+	pg->fillorder = FILLORDER_MSB2LSB;
+	pg->planar = PLANARCONFIG_CONTIG;
+
+	TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &pg->bps);
+	TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &pg->spp);
+	TIFFGetField(tif, TIFFTAG_COMPRESSION, &pg->compression);
+	TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &pg->photometric);
+	TIFFGetField(tif, TIFFTAG_PREDICTOR, &pg->predictor);
+	TIFFGetField(tif, TIFFTAG_FILLORDER, &pg->fillorder);
+	TIFFGetField(tif, TIFFTAG_PLANARCONFIG, &pg->planar);
+	TIFFGetField(tif, TIFFTAG_EXTRASAMPLES, &nextra, &extra);
+	TIFFGetField(tif, TIFFTAG_XRESOLUTION, &xres);
+	TIFFGetField(tif, TIFFTAG_YRESOLUTION, &yres);
+
+	pg->colors = pg->spp - nextra;
+	if (pg->colors != 1 && pg->colors != 3)
+		return -1;
+
+	/* have libtiff turn YCbCr back into RGB when decoding */
+	if (pg->compression == COMPRESSION_JPEG
+	    && pg->photometric == PHOTOMETRIC_YCBCR)
+		TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+
+	if (pg->planar != PLANARCONFIG_CONTIG)
+		return -1;
+
+	if (pg->bps != 1 && pg->bps != 8 && pg->bps != 16)
+		return -1;
+
+	pg->sx = 72.0 / (xres > 0 ? xres : 72.0);
+	pg->sy = 72.0 / (yres > 0 ? yres : 72.0);
+
+	pg->tiled = TIFFIsTiled(tif);
+
+	if (pg->tiled) {
+		TIFFGetField(tif, TIFFTAG_TILEWIDTH, &pg->piece_width);
+		TIFFGetField(tif, TIFFTAG_TILELENGTH, &pg->piece_height);
+		pg->npieces = TIFFNumberOfTiles(tif);
+	} else {
+		pg->piece_width = pg->width;
+		pg->piece_height = pg->height;
+		TIFFGetField(tif, TIFFTAG_ROWSPERSTRIP, &pg->piece_height);
+		if (pg->piece_height > pg->height)
+			pg->piece_height = pg->height;
+		pg->npieces = TIFFNumberOfStrips(tif);
+	}
+
+	return 0;
+}
+
+static int
+pdf_write_page(struct pdf *pdf, TIFF *tif)
+{
+	struct pdf_page pg;
+	char *content = NULL, *resources = NULL;
+	size_t content_len, resources_len;
+	FILE *c, *r;
+	int direct, obj, content_obj, page_obj = -1;
+	uint32_t piece;
+
+	if (pdf_page_info(tif, &pg) != 0) {
+		printf("cannot convert this kind of image to PDF\n");
+		return -1;
+	}
+
+	direct = pdf_embeddable(tif, &pg);
+
+	c = open_memstream(&content, &content_len);
+	r = open_memstream(&resources, &resources_len);
+	if (c == NULL || r == NULL)
+		goto out;
+
+	/* tiles may extend past the image */
+	fprintf(c, "0 0 %.4f %.4f re W n\n",
+		pg.width * pg.sx, pg.height * pg.sy);
+
+	if (!pg.tiled && pg.piece_height < PDF_MIN_STRIP_ROWS) {
+
+		/* too many tiny strips, make a single image of them */
+		obj = pdf_write_decoded(pdf, tif, &pg, 0, pg.npieces - 1,
+					pg.width, pg.height);
+		if (obj < 0)
+			goto out;
+
+		fprintf(c, "q %.4f 0 0 %.4f 0 0 cm /I0 Do Q\n",
+			pg.width * pg.sx, pg.height * pg.sy);
+		fprintf(r, "/I0 %d 0 R ", obj);
+
+	} else for (piece = 0; piece < pg.npieces; piece++) {
+		uint32_t across = (pg.width + pg.piece_width - 1)
+			/ pg.piece_width;
+		uint32_t x, y, h;
+
+		if (pg.tiled) {
+			x = (piece % across) * pg.piece_width;
+			y = (piece / across) * pg.piece_height;
+			h = pg.piece_height;
+		} else {
+			x = 0;
+			y = piece * pg.piece_height;
+			h = pg.height - y < pg.piece_height ?
+				pg.height - y : pg.piece_height;
+		}
+
+		if (direct)
+			obj = pdf_write_raw(pdf, tif, &pg, piece,
+					    pg.piece_width, h);
+		else
+			obj = pdf_write_decoded(pdf, tif, &pg, piece, piece,
+						pg.piece_width, h);
+		if (obj < 0)
+			goto out;
+
+		/* PDF counts from the bottom */
+		fprintf(c, "q %.4f 0 0 %.4f %.4f %.4f cm /I%u Do Q\n",
+			pg.piece_width * pg.sx, h * pg.sy, x * pg.sx,
+			((double) pg.height - y - h) * pg.sy, piece);
+		fprintf(r, "/I%u %d 0 R ", piece, obj);
+	}
+
+	fclose(c);
+	fclose(r);
+	c = r = NULL;
+
+	content_obj = pdf_obj_new(pdf);
+	page_obj = pdf_obj_new(pdf);
+	if (content_obj < 0 || page_obj < 0) {
+		page_obj = -1;
+		goto out;
+	}
+
+	pdf_obj_begin(pdf, content_obj);
+	fprintf(pdf->fp, "<< /Length %ld >>\nstream\n", (long) content_len);
+	fwrite(content, 1, content_len, pdf->fp);
+	fputs("endstream\n", pdf->fp);
+	pdf_obj_end(pdf);
+
+	pdf_obj_begin(pdf, page_obj);
+	fprintf(pdf->fp, "<< /Type /Page /Parent 2 0 R "
+		"/MediaBox [0 0 %.4f %.4f] /Resources << /XObject << %s>> >> "
+		"/Contents %d 0 R >>\n", pg.width * pg.sx, pg.height * pg.sy,
+		resources, content_obj);
+	pdf_obj_end(pdf);
+
+out:
+	if (c)
+		fclose(c);
+	if (r)
+		fclose(r);
+
+	free(content);
+	free(resources);
+
+	return page_obj;
+}
+
+static int
+pdf_write(const char *tif_name, const char *pdf_name)
+{
+	struct pdf pdf;
+	TIFF *tif;
+	int *kids = NULL, nkids = 0;
+	int i, err = 0;
+	long xref;
+
+	tif = TIFFOpen(tif_name, "r");
+	if (tif == NULL)
+		return -1;
+
+	memset(&pdf, 0x00, sizeof(pdf));
+
+	pdf.fp = fopen(pdf_name, "w");
+	if (pdf.fp == NULL) {
+		TIFFClose(tif);
+		return -1;
+	}
+
+	/* 1 is the catalog, 2 the page tree */
+	pdf_obj_new(&pdf);
+	pdf_obj_new(&pdf);
+
+	fputs("%PDF-1.5\n%\xe2\xe3\xcf\xd3\n", pdf.fp);
+
+	pdf_obj_begin(&pdf, 1);
+	fputs("<< /Type /Catalog /Pages 2 0 R >>\n", pdf.fp);
+	pdf_obj_end(&pdf);
+
+	do {
+		int *k, page = pdf_write_page(&pdf, tif);
+
+		if (page < 0) {
+			err = -1;
+			break;
+		}
+
+		k = realloc(kids, (nkids + 1) * sizeof(int));
+		if (k == NULL) {
+			err = -1;
+			break;
+		}
+
+		kids = k;
+		kids[nkids++] = page;
+
+	} while (TIFFReadDirectory(tif));
+
+	pdf_obj_begin(&pdf, 2);
+	fputs("<< /Type /Pages /Kids [", pdf.fp);
+	for (i = 0; i < nkids; i++)
+		fprintf(pdf.fp, " %d 0 R", kids[i]);
+	fprintf(pdf.fp, " ] /Count %d >>\n", nkids);
+	pdf_obj_end(&pdf);
+
+	xref = ftell(pdf.fp);
+
+	fprintf(pdf.fp, "xref\n0 %d\n0000000000 65535 f \n", pdf.nobjs + 1);
+	for (i = 1; i <= pdf.nobjs; i++)
+		fprintf(pdf.fp, "%010ld 00000 n \n", pdf.offsets[i]);
+
+	fprintf(pdf.fp, "trailer\n<< /Size %d /Root 1 0 R >>\n"
+		"startxref\n%ld\n%%%%EOF\n", pdf.nobjs + 1, xref);
+
+	if (fclose(pdf.fp) != 0)
+		err = -1;
+
+	TIFFClose(tif);
+	free(pdf.offsets);
+	free(kids);
+
+	return err;
+}
+
+/* convert a closed TIFF file, foo.tif becomes foo.pdf */
+static int
+tiff2pdf(const char *tif)
+{
+	int len = strlen(tif), err;
+	char *pdf = malloc(len + 4 + 1);
+
+	if (pdf == NULL) {
+		printf("out of memory\n");
+		return -1;
+	}
+
+	strcpy(pdf, tif);
+
+	// truncate the extension if .tif
+	if (len > 4 && pdf[len - 1 - 3] == '.')
+		pdf[len - 1 - 3] = '\0';
+
+	strcat(pdf, ".pdf");
+
+	printf("Saving PDF to %s\n", pdf);
+
+	err = pdf_write(tif, pdf);
+	if (err)
+		printf("error while writing %s\n", pdf);
+
+	free(pdf);
+
+	return err;
+}
+
+/* XXX page.c */
+
+/* Pages are finished by a single worker, in order, while the scanner
+ * is already feeding the next sheet. As long as a job holds a file
+ * that stays open, for multi-page files, scan_to_tiff() waits for it
+ * before touching the file again. All the devices share the worker.
+ */
+
+#define PAGE_WRITE	1	/* write the directory of the page */
+#define PAGE_CLOSE	2	/* flush, sync and close the file */
+#define PAGE_PDF	4	/* then convert it to PDF */
+#define PAGE_DISCARD	8	/* take the directory out again, blank page */
+
+struct page_job {
+	struct job job;		/* must be first */
+	struct device *dev;
+	TIFF *image;
+	struct pyramid *pyr;
+	int flags;
+	int stream;		/* a page of --stream */
+	int has_stats;
+	struct stats stats;
+};
+
+static struct pool *page_pool;
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t page_cond = PTHREAD_COND_INITIALIZER;
+
+static int
+tiff_close(TIFF *image)
+{
+	int err = 0;
+
+	/* sent already, see page_run() */
+	if (stream_page(image)) {
+		TIFFClose(image);
+		return 0;
+	}
+
+	if (!TIFFFlush(image) || tiff_io_flush(image) != 0
+	    || fsync(TIFFFileno(image)) != 0)
+		err = -1;
+
+	TIFFClose(image);
+
+	return err;
+}
+
+static void
+page_run(struct job *job)
+{
+	struct page_job *pj = (struct page_job *) job;
+	struct device *dev = pj->dev;
+	char *name = strdup(TIFFFileName(pj->image));
+	double t0 = stats_clock();
+	int fd = TIFFFileno(pj->image);
+	struct stat sb;
+	int err = 0;
+
+	/* the reduced levels of a blank page are not written at all */
+	if ((pj->flags & PAGE_DISCARD) && pj->pyr) {
+		pyramid_free(pj->pyr);
+		pj->pyr = NULL;
+	}
+
+	if (pj->flags & PAGE_WRITE)
+		err = tiff_write_page(pj->image, pj->pyr);
+
+	/* libtiff cannot drop a directory it has not written, a blank page
+	 * is written and then unlinked. The file is then cut back to where
+	 * the page began, its strips and directory go with it. Never the
+	 * first page, see scan().
+	 */
+	if (!err && (pj->flags & PAGE_DISCARD)
+	    && (!TIFFUnlinkDirectory(pj->image,
+				     TIFFNumberOfDirectories(pj->image))
+		|| (dev->page_offset
+		    && tiff_truncate(pj->image, dev->page_offset) != 0)))
+		err = -1;
+
+	/* the size and the journal look at the file itself */
+	if (!err && tiff_io_flush(pj->image) != 0)
+		err = -1;
+
+	if (!err && pj->stream && (pj->flags & PAGE_CLOSE)
+	    && stream_end(pj->image) != 0)
+		err = -1;
+
+	if (pj->has_stats && pj->stream) {
+		pj->stats.file_bytes = stream_bytes(pj->image);
+	} else if (pj->has_stats && fstat(TIFFFileno(pj->image), &sb) == 0) {
+		pj->stats.file_bytes = sb.st_size - dev->page_offset;
+		dev->page_offset = sb.st_size;
+	}
+
+	if (pj->flags & PAGE_CLOSE)
+		dev->page_offset = 0;
+
+	if ((pj->flags & PAGE_CLOSE) && tiff_close(pj->image) != 0)
+		err = -1;
+
+	/* a streamed page is out before the next one begins */
+	if (!(pj->flags & PAGE_CLOSE) || pj->stream) {
+		pthread_mutex_lock(&page_lock);
+		dev->page_busy--;
+		pthread_cond_broadcast(&page_cond);
+		pthread_mutex_unlock(&page_lock);
+	}
+
+	if (err)
+		printf("error while writing %s\n", name ? name : "page");
+
+	/* on disk, as far as a batch can be resumed */
+	if (!err && pj->has_stats && (pj->flags & PAGE_WRITE))
+		journal_page(&dev->journal, pj->flags & PAGE_CLOSE ? -1 : fd,
+			     pj->stats.pageno);
+
+	if (!err && name && (pj->flags & PAGE_PDF))
+		err = tiff2pdf(name);
+
+	if (err) {
+		pthread_mutex_lock(&page_lock);
+		dev->page_status = SANE_STATUS_IO_ERROR;
+		pthread_mutex_unlock(&page_lock);
+	}
+
+	if (pj->has_stats) {
+		pj->stats.finish_time = stats_clock() - t0;
+		dev->stats_pages++;
+		stats_add(&dev->stats_total, &pj->stats);
+		stats_page(device_tag(dev), &pj->stats);
+	}
+
+	free(name);
+
+	pthread_mutex_lock(&page_lock);
+	dev->page_queued--;
+	pthread_cond_broadcast(&page_cond);
+	pthread_mutex_unlock(&page_lock);
+}
+
+/* hand the page over to the worker, pyr is freed. st may be NULL. */
+static void
+page_finish(struct device *dev, TIFF *image, struct pyramid *pyr,
+	    const struct stats *st, int flags)
+{
+	struct page_job *pj = calloc(1, sizeof(*pj));
+
+	if (pj == NULL) {
+		printf("out of memory\n");
+
+		pthread_mutex_lock(&page_lock);
+		dev->page_status = SANE_STATUS_NO_MEM;
+		pthread_mutex_unlock(&page_lock);
+
+		if (pyr)
+			pyramid_free(pyr);
+		if (flags & PAGE_CLOSE)
+			TIFFClose(image);
+		return;
+	}
+
+	pthread_mutex_lock(&page_lock);
+	if (page_pool == NULL)
+		page_pool = pool_create(1);
+	pthread_mutex_unlock(&page_lock);
+
+	pj->job.run = page_run;
+	pj->job.detached = 1;
+	pj->dev = dev;
+	pj->image = image;
+	pj->pyr = pyr;
+	pj->flags = flags;
+	pj->stream = stream_page(image);
+
+	if (st) {
+		pj->has_stats = 1;
+		pj->stats = *st;
+	}
+
+	pthread_mutex_lock(&page_lock);
+	if (!(flags & PAGE_CLOSE) || pj->stream)
+		dev->page_busy++;
+	dev->page_queued++;
+	pthread_mutex_unlock(&page_lock);
+
+	pool_submit(page_pool, &pj->job);
+}
+
+/* wait until no job uses a file of the device that is still open, and
+ * over the budget until its pages are written
+ */
+static void
+page_wait(struct device *dev)
+{
+	pthread_mutex_lock(&page_lock);
+	if (dev->page_queued && !dev->page_busy && budget_over())
+		budget_held();
+	while (dev->page_busy || (dev->page_queued && budget_over()))
+		pthread_cond_wait(&page_cond, &page_lock);
+	pthread_mutex_unlock(&page_lock);
+}
+
+/* first error of a finished page of the device, if any */
+static SANE_Status
+page_error(struct device *dev)
+{
+	SANE_Status status;
+
+	pthread_mutex_lock(&page_lock);
+	status = dev->page_status;
+	pthread_mutex_unlock(&page_lock);
+
+	return status;
+}
+
+static void
+page_nop(struct job *job)
+{
+}
+
+/* wait for the pages handed over so far to be finished, the worker
+ * takes them in order
+ */
+static SANE_Status
+page_sync(struct device *dev)
+{
+	struct pool *p;
+	struct job job;
+
+	memset(&job, 0x00, sizeof(job));
+	job.run = page_nop;
+
+	pthread_mutex_lock(&page_lock);
+	p = page_pool;
+	pthread_mutex_unlock(&page_lock);
+
+	if (p) {
+		pool_submit(p, &job);
+		pool_wait(p, &job);
+	}
+
+	return page_error(dev);
+}
+
+/* all the devices are done */
+static void
+page_stop(void)
+{
+	if (page_pool) {
+		pool_destroy(page_pool);
+		page_pool = NULL;
+	}
+}
+
+static SANE_Status
+scan(struct device *dev)
+{
+	char readbuf[2];
+	char *readbuf2;
+	char *cwd = get_current_dir_name();
+	char *output_file;
+	const char *tag = device_tag(dev);
+
+	TIFF *image = NULL;
+
+	int n = batch_start_at;
+	int count = batch_amount;
+
+	SANE_Status status = SANE_STATUS_GOOD;
+	struct pyramid *pyr;
+	struct stats st;
+	double start;
+	int resumed = 0;
+
+	/* a file, or a frame of the stream, for each page */
+	int split = !multi || stream_format;
+
+	int resolution = get_resolution(dev);	/* XXX */
+	double estimate;
+	int bigtiff;
+
+	signal(SIGHUP, sighandler);
+	signal(SIGINT, sighandler);
+	/* a reader going away is a write error of the stream */
+	signal(SIGPIPE, daemon_socket || stream_format ? SIG_IGN : sighandler);
+	signal(SIGTERM, sighandler);
+
+	if (resume && (!batch || dev->output_file == NULL)) {
+		printf("--resume needs the --batch and --output-file of the batch\n");
+		free(cwd);
+		return SANE_STATUS_INVAL;
+	}
+
+	if (stream_format)
+		output_file = strdup(dev->output_file ? dev->output_file : "-");
+	else
+		output_file = device_output_file(dev);
+
+	if (output_file == NULL) {
+		printf("out of memory\n");
+		free(cwd);
+		return SANE_STATUS_NO_MEM;
+	}
+
+	if (record_file && record_begin(record_file, resolution) != 0) {
+		free(output_file);
+		free(cwd);
+		return SANE_STATUS_IO_ERROR;
+	}
+
+	/* recorded, a replay sizes the file the same way */
+	estimate = tiff_estimate(dev->handle);
+	bigtiff = estimate >= TIFF_BIGTIFF_SIZE;
+
+	if (stream_format && stream_start(dev, output_file) != 0) {
+		if (record_file)
+			record_end(record_file);
+		free(output_file);
+		free(cwd);
+		return SANE_STATUS_IO_ERROR;
+	}
+
+	printf("%s%sScanning to %s at %d dpi\n", tag ? tag : "",
+	       tag ? ": " : "", output_file, resolution);
+
+	if (resolution < 100)
+		printf("WARNING: you are scanning at a low dpi value, please check your parameters\n");
+
+	if (bigtiff && verbose)
+		printf("output will exceed 4 Gb, writing BigTIFF\n");
+
+	if (batch && !tag) {
+
+		if (batch_amount != BATCH_COUNT_UNLIMITED)
+			printf(" %d", batch_amount);
+		else
+			printf(" an unknown amount of");
+
+		printf(" pages, incrementing by %d, numbering from %d\n",
+		       batch_increment, batch_start_at);
+	}
+
+	dev->batch_count = 0;
+	dev->page_status = SANE_STATUS_GOOD;
+	memset(&dev->stats_total, 0x00, sizeof(dev->stats_total));
+	dev->stats_pages = 0;
+
+	if (batch && !stream_format) {
+		char *first = tiff_file_name(output_file, batch_start_at);
+
+		if (first == NULL || journal_start(&dev->journal, first,
+						   resolution, bigtiff) != 0) {
+			if (record_file)
+				record_end(record_file);
+			free(first);
+			free(output_file);
+			free(cwd);
+			return SANE_STATUS_IO_ERROR;
+		}
+
+		free(first);
+		resumed = dev->journal.pages;
+	}
+
+	if (resumed) {
+		printf("%s%sResuming after page %d, %d pages already scanned\n",
+		       tag ? tag : "", tag ? ": " : "",
+		       dev->journal.last_page, resumed);
+
+		n = dev->journal.last_page + batch_increment;
+		if (batch_amount > 0)
+			count = batch_amount - resumed;
+	}
+
+	start = stats_clock();
+
+	/* all the pages were there */
+	if (resumed && batch_amount > 0 && count <= 0)
+		goto done;
+
+	do {
+		/* open file if necessary, the file of a resumed multi-page
+		 * batch is named after its first page
+		 */
+		if (image == NULL && stream_format)
+			image = stream_open(dev, output_file, icc_profile,
+					    estimate);
+		else if (image == NULL && resumed && multi) {
+			struct stat sb;
+
+			image = tiff_open(output_file, icc_profile,
+					  batch_start_at, estimate, 1);
+
+			/* the pages of the file before the resume */
+			if (image && fstat(TIFFFileno(image), &sb) == 0)
+				dev->page_offset = sb.st_size;
+		}
+		else if (image == NULL)
+			image = tiff_open(output_file, icc_profile, n,
+					  estimate, 0);
+
+		if (image == NULL) {
+			printf("cannot open file\n");
+			status = SANE_STATUS_IO_ERROR;
+			break;
+		}
+
+		/* XXX check return code */
+
+		if (batch_prompt) {
+			printf("Place page no. %d on the scanner.\n", n);
+			printf("Press <RETURN> to continue.\n");
+			printf("Press Ctrl + D to terminate.\n");
+			readbuf2 = fgets(readbuf, 2, stdin);
+
+			if (readbuf2 == NULL) {
+				printf("Batch terminated, %d pages scanned\n",
+				       (n - batch_increment));
+				break;	/* get out of this loop */
+			}
+		}
+
+		/* lines of several devices would mix */
+		if (batch && !tag) {
+			printf("Scanning page %d... ", n);
+			fflush(stdout);
+		}
+
+		status = scan_to_tiff(dev, image, n,
+				      (batch_amount > 0) ? batch_amount : 0,
+				      resolution, &pyr, &st);
+
+		/* a previous page could not be written */
+		if (status == SANE_STATUS_GOOD
+		    || status == SANE_STATUS_EOF)
+			status = page_error(dev);
+
+		/* no more docs, stop here */
+		if (status == SANE_STATUS_NO_DOCS) {
+			printf("%s%sNo (more) documents in the scanner\n",
+			       tag ? tag : "", tag ? ": " : "");
+			break;
+		}
+
+		if (batch && tag) {
+
+			printf("%s: scanned page %d to %s .\n", tag, n,
+			       TIFFFileName(image));
+
+		} else if (batch) {
+
+			printf("to %s .\n", TIFFFileName(image));
+
+		} else if (verbose > 1) {
+			printf("Scanned page %d to %s .\n",
+			       n, TIFFFileName(image));
+		}
+
+		/* continue reading when EOF */
+		if (status == SANE_STATUS_EOF)
+			status = SANE_STATUS_GOOD;
+
+		/* any error? */
+		if (status != SANE_STATUS_GOOD) {
+			if (pyr)
+				pyramid_free(pyr);
+			break;
+		}
+
+		/* continuing... */
+
+		if (blank_page(&st)) {
+			printf("%s%spage %d is blank (%.3f%% dark), skipped\n",
+			       tag ? tag : "", tag ? ": " : "", n,
+			       100.0 * st.ink / st.samples);
+
+			/* its number goes to the next page. Nothing else
+			 * is in the file yet, drop it as a whole: libtiff
+			 * cannot unlink the first directory and go on.
+			 */
+			if (split || !(dev->batch_count + resumed)) {
+				char *name = strdup(TIFFFileName(image));
+
+				if (pyr)
+					pyramid_free(pyr);
+				TIFFClose(image);
+				image = NULL;
+
+				if (name && !stream_format)
+					unlink(name);
+				free(name);
+			} else
+				page_finish(dev, image, pyr, NULL,
+					    PAGE_WRITE | PAGE_DISCARD);
+			continue;
+		}
+
+		/* write current image, closing it if appropriate, while
+		 * the next one is scanned
+		 */
+		if ((batch || stream_format) && split) {
+			page_finish(dev, image, pyr, &st, PAGE_WRITE
+				    | PAGE_CLOSE | (pdf_mode ? PAGE_PDF : 0));
+			image = NULL;
+		} else
+			page_finish(dev, image, pyr, &st, PAGE_WRITE);
+
+		n += batch_increment;
+		count--;
+		dev->batch_count++;
+	}
+	while ((batch && (batch_amount == BATCH_COUNT_UNLIMITED || count)));
+
+done:
+
+	if (batch)
+		printf("%s%sScanned %d pages\n", tag ? tag : "",
+		       tag ? ": " : "", dev->batch_count);
+
+	if (image) {
+
+		/* the last directory must be on disk */
+		page_wait(dev);
+
+		/* If there are no more docs, we should delete the
+		 * otherwise empty file.
+		 */
+
+#if 0
+		printf("dir: %d/%d, lines: %d %d\n",
+			TIFFCurrentDirectory(image),
+			TIFFNumberOfDirectories(image),
+			TIFFNumberOfTiles(image),
+			TIFFNumberOfStrips(image));
+#endif
+
+		if (TIFFNumberOfDirectories(image) == 0 && !stream_format) {
+			unlink(TIFFFileName(image));
+		}
+
+		page_finish(dev, image, NULL, NULL, PAGE_CLOSE |
+			    (pdf_mode && dev->batch_count + resumed && multi ?
+			     PAGE_PDF : 0));
+	}
+
+	/* report errors of pages finished after the last scan */
+	if (status == SANE_STATUS_GOOD || status == SANE_STATUS_NO_DOCS) {
+		SANE_Status page_status = page_sync(dev);
+
+		if (page_status != SANE_STATUS_GOOD)
+			status = page_status;
+	} else
+		page_sync(dev);
+
+	if (stream_format)
+		stream_stop(dev);
+
+	if (record_file && record_end(record_file) != 0
+	    && (status == SANE_STATUS_GOOD || status == SANE_STATUS_NO_DOCS))
+		status = SANE_STATUS_IO_ERROR;
+
+	/* kept for --resume if the batch did not end well */
+	if (batch)
+		journal_end(&dev->journal, status == SANE_STATUS_GOOD
+			    || status == SANE_STATUS_NO_DOCS);
+
+	stats_close(tag, &dev->stats_total, dev->stats_pages,
+		    stats_clock() - start);
+
+	chdir(cwd);
+	free(cwd);
+	free(output_file);
+
+	return status;
+}
+
+/* input is in postscript points, 1/72 inch */
+static void
+set_scanning_area(struct device *dev, double width, double height)
+{
+	SANE_Word w = width / 72.0 * 10 * 2.54;	/* convert to mm */
+	SANE_Word h = height / 72.0 * 10 * 2.54;
+
+	if (verbose)
+		printf("Setting scanning area to %dx%d mm\n", w, h);
+
+	sane_set_opt_word(dev->handle, dev->corners[2], w);
+	sane_set_opt_word(dev->handle, dev->corners[3], h);
+}
+
+
+enum modes
+{ MODE_NONE, MODE_SCAN, MODE_LIST, MODE_ERROR, MODE_STOP,
+	MODE_VERSION, MODE_HELP
+};
+
+static int
+process_cmd_line(poptContext optc, int argc, const char **argv)
+{
+	int optrc;
+	int mode = MODE_NONE;
+
+	/* parse arguments */
+	for (optrc = 0; optrc != -1;) {
+
+		optrc = poptGetNextOpt(optc);
+
+		switch (optrc) {
+		case -1:
+			break;
+
+		case POPT_ERROR_BADOPT:
+        	        /* maybe a backend option */
+        	        break;
+
+		case OPT_VERBOSE:
+			verbose++;
+			break;
+
+		case OPT_LIST_DEVS:
+			/* after --refresh and --cache-ttl are known */
+			mode = MODE_LIST;
+			break;
+
+		case OPT_SCAN:
+			if (mode != MODE_NONE)
+				printf("BUG: mode is %d\n", mode);
+			else
+				mode = MODE_SCAN;
+			break;
+
+		case OPT_VERSION:
+			mode = MODE_VERSION;
+			break;
+
+		case OPT_HELP:
+			mode = MODE_HELP;
+			break;
+
+                /* this is saved here, do not use libopt automatic
+                 * assignment to a variable.
+                 */
+                case OPT_DEVICE:
+                        if (device_add(poptGetOptArg(optc)) != 0)
+                                mode = MODE_STOP;
+                        break;
+
+		default:
+			/* backend options, set aside by a --daemon */
+			if (optrc >= 1000)
+				break;
+
+			mode = MODE_STOP;
+			printf("%s: %s\n",
+			       poptBadOption(optc, POPT_BADOPTION_NOALIAS),
+			       poptStrerror(optrc));
+			/* immediately stop parsing options */
+			optrc = -1;
+			break;
+		}
+	}
+
+	if (mode == MODE_LIST) {
+		list_devices();
+		mode = MODE_STOP;
+	}
+
+	return mode;
+}
+
+
+/* the arguments of the n-th --device: those given before the first
+ * --device, then the ones following its own
+ */
+static const char **
+device_argv(int argc, const char **argv, int n, int *dargc)
+{
+	const char **dargv;
+	int i, cur = -1;
+
+	dargv = calloc(argc + 1, sizeof(*dargv));
+	if (dargv == NULL)
+		return NULL;
+
+	dargv[0] = argv[0];
+	*dargc = 1;
+
+	for (i = 1; i < argc; i++) {
+		const char *a = argv[i];
+		int sep = strcmp(a, "--device") == 0 || strcmp(a, "-d") == 0;
+
+		if (sep || strncmp(a, "--device=", 9) == 0
+		    || (a[0] == '-' && a[1] == 'd' && a[2])) {
+			cur++;
+			if (cur == n)
+				dargv[(*dargc)++] = a;
+			if (sep && i + 1 < argc) {
+				i++;
+				if (cur == n)
+					dargv[(*dargc)++] = argv[i];
 			}
+			continue;
+		}
 
-			TIFFClose(image);
-			image = NULL;
+		if (cur == -1 || cur == n)
+			dargv[(*dargc)++] = a;
+	}
+
+	return dargv;
+}
+
+static int
+process_backend_options(struct device *dev, int argc, const char **argv,
+			int mode)
+{
+	SANE_Status status;
+
+	int optrc;
+
+	/* enumerated once, --daemon jobs reuse the table */
+	if (dev->options == NULL) {
+		if (device_options(dev) != 0)
+			return MODE_STOP;
+
+		strext(&dev->options_desc, "Backend options for ");
+		strext(&dev->options_desc, dev->name);
+	}
+
+	/* include the backend options into the main table */
+	options[ARRAY_SIZE(options) - 2].argInfo = POPT_ARG_INCLUDE_TABLE;
+	options[ARRAY_SIZE(options) - 2].arg = dev->options;
+	options[ARRAY_SIZE(options) - 2].descrip = dev->options_desc;
+
+	poptContext optc = poptGetContext("tiffscan", argc, argv, options, 0);
+
+	while ((optrc = poptGetNextOpt(optc)) > 0) {
+
+		/* --help from the cache, the device is not open */
+		if (optrc >= 1000 && dev->handle) {	/* backend option */
+			status = process_backend_option(dev->handle,
+							optrc - 1000,
+							poptGetOptArg(optc));
+
+			if (status != SANE_STATUS_GOOD) {
+				mode = MODE_STOP;
+				break;
+			}
 		}
 
-		n += batch_increment;
-		count--;
-		batch_count++;
+		if (optrc == OPT_HELP) {
+			mode = MODE_STOP;
+			poptPrintHelp(optc, stdout, 0);
+                        break;
+		}
+
+		if (optrc == OPT_SCAN)
+			mode = MODE_SCAN;
+
+                if (optrc == OPT_DEVICE) {
+                        const char *d = poptGetOptArg(optc);
+
+                        if (d && strcmp(d, dev->name) != 0) {
+                                printf("WARNING: device name must be given before backend options\n");
+                                mode = MODE_STOP;
+                                break;
+                        }
+                }
 	}
-	while ((batch && (batch_amount == BATCH_COUNT_UNLIMITED || count)));
 
-	if (batch)
-		printf("Scanned %d pages\n", batch_count);
+	if (optrc < -1) {
+		mode = MODE_STOP;
+		printf("%s: %s\n",
+		       poptBadOption(optc, POPT_BADOPTION_NOALIAS),
+		       poptStrerror(optrc));
+	}
 
-	if (image) {
 
-		/* If there are no more docs, we should delete the
-		 * otherwise empty file.
-		 */
+	poptFreeContext(optc);
 
-#if 0
-		printf("dir: %d/%d, lines: %d %d\n",
-			TIFFCurrentDirectory(image),
-			TIFFNumberOfDirectories(image),
-			TIFFNumberOfTiles(image),
-			TIFFNumberOfStrips(image));
-#endif
+	return mode;
+}
 
-		if (TIFFNumberOfDirectories(image) == 0) {
-			unlink(TIFFFileName(image));
+static void *
+device_thread(void *arg)
+{
+	struct device *dev = arg;
+
+	dev->status = scan(dev);
+
+	return NULL;
+}
+
+static int
+run_scan(void)
+{
+	int i, rc = 0;
+
+	if (read_buffer && ring_parse_size(read_buffer) != 0) {
+		printf("bad read buffer size: %s\n", read_buffer);
+		return 1;
+	}
+
+	/* started for the --threads of a previous daemon job */
+	if (pool && pool->nthreads != pool_threads()) {
+		pool_destroy(pool);
+		pool = NULL;
+	}
+
+	if (convert_init() != 0 || binarize_init() != 0
+	    || tiff_codec_init() != 0 || stream_init() != 0)
+		return 1;
+
+	if (batch_prompt && ndevices > 1) {
+		printf("--batch-prompt cannot be used with several devices\n");
+		return 1;
+	}
+
+	/* there is a single source to record */
+	if (record_file && ndevices > 1) {
+		printf("--record cannot be used with several devices\n");
+		return 1;
+	}
+
+	if (ndevices == 1)
+		devices[0].output_file = output_file;
+
+	/* the pages of two devices would be mixed up */
+	for (i = 0; stream_format && i < ndevices; i++) {
+		const char *o = devices[i].output_file;
+		int j;
+
+		for (j = 0; j < i; j++) {
+			const char *p = devices[j].output_file;
+
+			if (strcmp(o ? o : "-", p ? p : "-") == 0) {
+				printf("%s and %s cannot stream to the same output\n",
+				       devices[j].name, devices[i].name);
+				return 1;
+			}
 		}
+	}
+
+	/* set scanning area size */
+	if (paper && source == &sane_source) {
+		const struct paper *pi = paperinfo(paper);
 
-		if (pdf_mode && batch_count && multi) {
-			tiff2pdf(image);
+		if (pi == NULL) {
+			printf("Unknown paper name: %s\n", paper);
+			return 1;
 		}
 
-		TIFFClose(image);
+		for (i = 0; i < ndevices; i++) {
+			struct device *dev = &devices[i];
+
+			if (dev->corners[2] == -1 || dev->corners[3] == -1) {
+				printf("Setting scanning area size is not supported on %s.\n",
+				       dev->name);
+				return 1;
+			}
+
+			set_scanning_area(dev, paperpswidth(pi),
+					  paperpsheight(pi));
+		}
 	}
 
-	chdir(cwd);
-	free(cwd);
+	// switch to output path, if requested
+	if (output_path) {
+		int err = chdir(output_path);
+		if (err != 0) {
+			printf("Cannot switch to %s: %s\n", output_path, strerror(errno));
+			return 1;
+		}
+	}
 
-	return status;
+	budget_init();
+	stats_open();
+
+	/* scan, one thread per device when there are several */
+	if (ndevices == 1)
+		devices[0].status = scan(&devices[0]);
+	else {
+		for (i = 0; i < ndevices; i++) {
+			devices[i].thread = 0;
+			if (pthread_create(&devices[i].thread, NULL,
+					   device_thread, &devices[i]) != 0) {
+				devices[i].thread = 0;
+				devices[i].status = scan(&devices[i]);
+			}
+		}
+
+		for (i = 0; i < ndevices; i++) {
+			if (devices[i].thread)
+				pthread_join(devices[i].thread, NULL);
+		}
+	}
+
+	page_stop();
+	tiff_io_stop();
+	budget_report();
+	stats_done();
+
+	for (i = 0; i < ndevices; i++) {
+		struct device *dev = &devices[i];
+		SANE_Status status = dev->status;
+
+		if (batch && dev->batch_count == 0
+		    && status == SANE_STATUS_NO_DOCS && rc == 0)
+			rc = 2;
+
+		if (status != SANE_STATUS_GOOD && status != SANE_STATUS_NO_DOCS
+			&& status != SANE_STATUS_CANCELLED) {
+			if (ndevices > 1)
+				printf("%s: ", dev->name);
+			printf("SANE error: %s\n", sane_strstatus(status));
+			rc = 1;
+		}
+	}
+
+	return rc;
 }
 
-/* input is in postscript points, 1/72 inch */
+/* XXX daemon.c */
+
+/* With --daemon the device is opened, and its options enumerated, once.
+ * Each tiffscan --connect sends its working directory and arguments,
+ * NUL terminated, and gets back what the scan printed, a NUL and the
+ * exit code. A job starts from the daemon's own command line: the
+ * tiffscan options are put back from a copy and the backend options
+ * that the previous job changed are set again. Options that already
+ * have the wanted value are not sent to the backend.
+ */
+
+#define DAEMON_REQUEST_MAX	(64 * 1024)
+
+static union {
+	int i;
+	double d;
+	char *s;
+} daemon_saved[ARRAY_SIZE(options)];
+static int daemon_saved_verbose;
+
+struct daemon_option {
+	int optnum;
+	void *value;
+};
+
+static struct daemon_option *daemon_options;
+static int daemon_noptions;
+static volatile sig_atomic_t daemon_stop;
+
 static void
-set_scanning_area(SANE_Handle handle, double width, double height)
+daemon_sighandler(int signum)
 {
-	SANE_Word w = width / 72.0 * 10 * 2.54;	/* convert to mm */
-	SANE_Word h = height / 72.0 * 10 * 2.54;
+	daemon_stop = 1;
+}
+
+static int
+daemon_address(const char *path, struct sockaddr_un *sun)
+{
+	if (strlen(path) >= sizeof(sun->sun_path)) {
+		printf("socket name too long: %s\n", path);
+		return -1;
+	}
+
+	memset(sun, 0x00, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, path);
+
+	return 0;
+}
+
+static void
+daemon_save(SANE_Handle handle)
+{
+	SANE_Int count = 0;
+	int i;
+
+	for (i = 0; options[i].longName; i++) {
+		void *arg = options[i].arg;
+
+		if (arg == NULL)
+			continue;
+
+		switch (options[i].argInfo & POPT_ARG_MASK) {
+		case POPT_ARG_STRING:
+			daemon_saved[i].s = *(char **) arg;
+			break;
+		case POPT_ARG_DOUBLE:
+			daemon_saved[i].d = *(double *) arg;
+			break;
+		default:
+			daemon_saved[i].i = *(int *) arg;
+			break;
+		}
+	}
+
+	daemon_saved_verbose = verbose;
+
+	if (source != &sane_source)
+		return;
+
+	if (sane_control_option(handle, 0, SANE_ACTION_GET_VALUE, &count,
+				0) != SANE_STATUS_GOOD || count <= 1)
+		return;
+
+	daemon_options = calloc(count, sizeof(*daemon_options));
+	if (daemon_options == NULL)
+		return;
+
+	for (i = 1; i < count; i++) {
+		const SANE_Option_Descriptor *opt;
+		struct daemon_option *o = &daemon_options[daemon_noptions];
+
+		opt = sane_get_option_descriptor(handle, i);
+		if (opt == NULL || !SANE_OPTION_IS_SETTABLE(opt->cap)
+		    || !SANE_OPTION_IS_ACTIVE(opt->cap)
+		    || opt->type == SANE_TYPE_GROUP
+		    || opt->type == SANE_TYPE_BUTTON || opt->size <= 0)
+			continue;
+
+		o->value = malloc(opt->size);
+		if (o->value == NULL)
+			continue;
+
+		if (sane_control_option(handle, i, SANE_ACTION_GET_VALUE,
+					o->value, 0) != SANE_STATUS_GOOD) {
+			free(o->value);
+			continue;
+		}
+
+		o->optnum = i;
+		daemon_noptions++;
+	}
+}
+
+static void
+daemon_restore(SANE_Handle handle)
+{
+	int i;
+
+	for (i = 0; options[i].longName; i++) {
+		void *arg = options[i].arg;
+
+		if (arg == NULL)
+			continue;
+
+		switch (options[i].argInfo & POPT_ARG_MASK) {
+		case POPT_ARG_STRING:
+			/* popt hands out copies of the arguments */
+			if (*(char **) arg != daemon_saved[i].s)
+				free(*(char **) arg);
+			*(char **) arg = daemon_saved[i].s;
+			break;
+		case POPT_ARG_DOUBLE:
+			*(double *) arg = daemon_saved[i].d;
+			break;
+		default:
+			*(int *) arg = daemon_saved[i].i;
+			break;
+		}
+	}
+
+	verbose = daemon_saved_verbose;
+
+	/* built for the --gamma and --sample-bits of the previous job */
+	free(convert_lut);
+	convert_lut = NULL;
+
+	/* set only when a job gives --read-buffer */
+	ring_min_size = RING_MIN_SIZE;
+	ring_max_size = RING_MAX_SIZE;
+
+	for (i = 0; i < daemon_noptions; i++) {
+		const SANE_Option_Descriptor *opt;
+
+		opt = sane_get_option_descriptor(handle,
+						 daemon_options[i].optnum);
+		if (opt && SANE_OPTION_IS_ACTIVE(opt->cap))
+			set_option(handle, daemon_options[i].optnum,
+				   daemon_options[i].value);
+	}
+}
+
+static void
+daemon_free(void)
+{
+	int i;
+
+	for (i = 0; i < daemon_noptions; i++)
+		free(daemon_options[i].value);
+
+	free(daemon_options);
+	daemon_options = NULL;
+	daemon_noptions = 0;
+}
+
+/* what main() does after opening the device, for one job */
+static int
+daemon_scan(int argc, const char **argv)
+{
+	struct device *dev;
+	poptContext optc;
+	int mode, rc;
+
+	optc = poptGetContext("tiffscan", argc, argv, options,
+			      POPT_CONTEXT_POSIXMEHARDER);
+	mode = process_cmd_line(optc, argc, argv);
+	poptFreeContext(optc);
+
+	/* moved if --device was given */
+	dev = &devices[0];
+
+	/* the --device of the job, if any, must be the open one */
+	while (ndevices > 1) {
+		struct device *d = &devices[--ndevices];
+
+		if (strcmp(d->name, dev->name) != 0 && mode != MODE_STOP) {
+			printf("this daemon scans with %s\n", dev->name);
+			mode = MODE_STOP;
+		}
+		free(d->name);
+	}
+
+	if (mode == MODE_VERSION)
+		printf("tiffscan %d.%d (%s)\n", __VERSION, __REVISION,
+		       __DATE__);
+
+	if (mode == MODE_VERSION || mode == MODE_STOP)
+		return 0;
+
+	if (batch_prompt) {
+		printf("--batch-prompt cannot be used with --connect\n");
+		return 1;
+	}
+
+	if (source == &synthetic_source || source == &replay_source) {
+		if (mode != MODE_SCAN) {
+			printf("Use --scan to begin scanning, --help for details.\n");
+			return 0;
+		}
+
+		/* a fresh set of pages for each job */
+		dev->handle = source == &replay_source ?
+			replay_open(replay_file) : synthetic_open(synthetic);
+		if (dev->handle == NULL)
+			return 1;
+
+		rc = run_scan();
+
+		source->close(dev->handle);
+		dev->handle = NULL;
 
-	if (verbose)
-		printf("Setting scanning area to %dx%d mm\n", w, h);
+		return rc;
+	}
 
-	sane_set_opt_word(handle, corners[2], w);
-	sane_set_opt_word(handle, corners[3], h);
-}
+	mode = process_backend_options(dev, argc, argv, mode);
+	if (mode == MODE_STOP)
+		return 0;
 
+	if (mode != MODE_SCAN) {
+		printf("Use --scan to begin scanning, --help for details.\n");
+		return 0;
+	}
 
-enum modes
-{ MODE_NONE, MODE_SCAN, MODE_LIST, MODE_ERROR, MODE_STOP,
-	MODE_VERSION, MODE_HELP
-};
+	return run_scan();
+}
 
 static int
-process_cmd_line(poptContext optc, int argc, const char **argv)
+daemon_job(int fd)
 {
-	int optrc;
-	int mode = MODE_NONE;
+	char *request = NULL, *p, tail[16];
+	const char **argv = NULL;
+	size_t len = 0, size = 0;
+	int argc, out, rc = 1;
 
-	/* parse arguments */
-	for (optrc = 0; optrc != -1;) {
+	/* the client shuts its side down after the request */
+	for (;;) {
+		ssize_t n;
 
-		optrc = poptGetNextOpt(optc);
+		if (len == size) {
+			if (size == DAEMON_REQUEST_MAX)
+				break;
+			size = size ? size * 2 : 4096;
+			p = realloc(request, size);
+			if (p == NULL)
+				break;
+			request = p;
+		}
 
-		switch (optrc) {
-		case -1:
+		n = read(fd, request + len, size - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
 			break;
 
-		case POPT_ERROR_BADOPT:
-        	        /* maybe a backend option */
-        	        break;
+		len += n;
+	}
 
-		case OPT_VERBOSE:
-			verbose++;
-			break;
+	/* nothing at all is another daemon checking on us */
+	if (len == 0 || request[len - 1] != '\0') {
+		if (len)
+			printf("bad request\n");
+		free(request);
+		return -1;
+	}
 
-		case OPT_LIST_DEVS:
-			mode = MODE_STOP;
-			list_devices();
-			break;
+	/* the working directory takes the place of argv[0] */
+	for (argc = 0, p = request; p < request + len; p += strlen(p) + 1)
+		argc++;
 
-		case OPT_SCAN:
-			if (mode != MODE_NONE)
-				printf("BUG: mode is %d\n", mode);
-			else
-				mode = MODE_SCAN;
-			break;
+	argv = calloc(argc + 1, sizeof(*argv));
+	if (argv == NULL) {
+		free(request);
+		return -1;
+	}
 
-		case OPT_VERSION:
-			mode = MODE_VERSION;
-			break;
+	argv[0] = "tiffscan";
+	for (argc = 1, p = request + strlen(request) + 1;
+	     p < request + len; p += strlen(p) + 1)
+		argv[argc++] = p;
 
-		case OPT_HELP:
-			mode = MODE_HELP;
-			break;
+	/* everything printed goes to the client */
+	fflush(stdout);
+	out = dup(STDOUT_FILENO);
+	dup2(fd, STDOUT_FILENO);
 
-                /* this is saved here, do not use libopt automatic
-                 * assignment to a variable.
-                 */
-                case OPT_DEVICE:
-                        devname = poptGetOptArg(optc);
-                        break;
+	daemon_restore(devices[0].handle);
 
-		default:
-			mode = MODE_STOP;
-			printf("%s: %s\n",
-			       poptBadOption(optc, POPT_BADOPTION_NOALIAS),
-			       poptStrerror(optrc));
-			/* immediately stop parsing options */
-			optrc = -1;
-			break;
-		}
-	}
+	if (chdir(request) != 0)
+		printf("Cannot switch to %s: %s\n", request, strerror(errno));
+	else
+		rc = daemon_scan(argc, argv);
 
-	return mode;
-}
+	fflush(stdout);
+	dup2(out, STDOUT_FILENO);
+	close(out);
+
+	tail[0] = '\0';
+	snprintf(tail + 1, sizeof(tail) - 1, "%d\n", rc);
+	scratch_write(fd, tail, strlen(tail + 1) + 1);
 
+	free(argv);
+	free(request);
+
+	return rc;
+}
 
 static int
-process_backend_options(SANE_Handle handle, int argc, const char **argv,
-			int mode)
+daemon_run(const char *path)
 {
-	SANE_Status status;
+	struct sockaddr_un sun;
+	struct sigaction sa;
+	char *cwd;
+	int fd, jobs = 0;
+
+	if (daemon_address(path, &sun) != 0)
+		return 1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		printf("cannot create a socket: %s\n", strerror(errno));
+		return 1;
+	}
 
-	int optrc;
-	struct poptOption *dev_options;
+	/* a socket nobody answers on is left over from a dead daemon */
+	if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == 0) {
+		printf("a tiffscan daemon is already listening on %s\n", path);
+		close(fd);
+		return 1;
+	}
 
-	dev_options = fetch_options(handle);
-	if (dev_options == NULL)
-		return MODE_STOP;
+	if (errno == ECONNREFUSED)
+		unlink(path);
 
-	/* include the backend options into the main table */
-	char *bopt = "Backend options for ";
-	char *desc = malloc(strlen(bopt) + strlen(devname) + 1);
+	close(fd);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
-	strcpy(desc, bopt);
-	strcat(desc, devname);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &sun, sizeof(sun)) != 0
+	    || listen(fd, 8) != 0) {
+		printf("cannot listen on %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
 
-	options[ARRAY_SIZE(options) - 2].argInfo = POPT_ARG_INCLUDE_TABLE;
-	options[ARRAY_SIZE(options) - 2].arg = dev_options;
-	options[ARRAY_SIZE(options) - 2].descrip = desc;
+	daemon_save(devices[0].handle);
+	cwd = get_current_dir_name();
 
-	poptContext optc = poptGetContext("tiffscan", argc, argv, options, 0);
+	printf("Waiting for scans on %s\n", path);
 
-	while ((optrc = poptGetNextOpt(optc)) > 0) {
+	/* the clients see the progress of their scan as it happens */
+	fflush(stdout);
+	setvbuf(stdout, NULL, _IOLBF, 0);
 
-		if (optrc >= 1000) {	/* backend option */
-			status = process_backend_option(handle,
-							optrc - 1000,
-							poptGetOptArg(optc));
+	memset(&sa, 0x00, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
 
-			if (status != SANE_STATUS_GOOD) {
-				mode = MODE_STOP;
-				break;
-			}
-		}
+	/* a client that goes away must not take the daemon along */
+	signal(SIGPIPE, SIG_IGN);
 
-		if (optrc == OPT_HELP) {
-			mode = MODE_STOP;
-			poptPrintHelp(optc, stdout, 0);
-                        break;
-		}
+	while (!daemon_stop) {
+		double start;
+		int client, rc;
 
-		if (optrc == OPT_SCAN)
-			mode = MODE_SCAN;
+		/* scan() has its own handlers, accept() must be interrupted */
+		sa.sa_handler = daemon_sighandler;
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
 
-                if (optrc == OPT_DEVICE) {
-                        const char *d = poptGetOptArg(optc);
+		client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			printf("accept failed: %s\n", strerror(errno));
+			break;
+		}
 
-                        if (d && strcmp(d, devname) != 0) {
-                                printf("WARNING: device name must be given before backend options\n");
-                                mode = MODE_STOP;
-                                break;
-                        }
-                }
-	}
+		start = stats_clock();
+		rc = daemon_job(client);
+		close(client);
 
-	if (optrc < -1) {
-		mode = MODE_STOP;
-		printf("%s: %s\n",
-		       poptBadOption(optc, POPT_BADOPTION_NOALIAS),
-		       poptStrerror(optrc));
-	}
+		if (rc >= 0)
+			printf("job %d done in %.2f s, exit code %d\n",
+			       ++jobs, stats_clock() - start, rc);
 
+		/* jobs run in the directory of their client */
+		if (cwd)
+			chdir(cwd);
+	}
 
-	poptFreeContext(optc);
-	free(desc);
-	free(dev_options);
+	close(fd);
+	unlink(path);
+	daemon_free();
+	free(cwd);
 
-	return mode;
+	return 0;
 }
 
-int
-main(int argc, const char **argv)
+/* the client side, no SANE needed */
+static int
+daemon_connect(int argc, const char **argv)
 {
-	int rc = 0, mode = MODE_NONE;
+	struct sockaddr_un sun;
+	const char *path = NULL;
+	char *request = NULL, *cwd, buf[4096], code[16];
+	size_t len = 0, clen = 0;
+	int fd, i, done = 0;
+
+	cwd = get_current_dir_name();
+	if (cwd == NULL) {
+		printf("cannot get the working directory: %s\n",
+		       strerror(errno));
+		return 1;
+	}
 
-	SANE_Int version;
-	SANE_Status status;
+	/* the working directory goes in place of argv[0] */
+	for (i = 0; i < argc; i++) {
+		const char *arg = i ? argv[i] : cwd;
+		size_t n;
+		char *p;
 
-	atexit(tiffscan_exit);
+		if (i && strcmp(arg, "--connect") == 0 && i + 1 < argc) {
+			path = argv[++i];
+			continue;
+		}
 
-	paperinit();
+		if (i && strncmp(arg, "--connect=", 10) == 0) {
+			path = arg + 10;
+			continue;
+		}
 
-	sane_init(&version, NULL);
+		n = strlen(arg) + 1;
+		p = realloc(request, len + n);
+		if (p == NULL) {
+			free(request);
+			free(cwd);
+			return 1;
+		}
 
-	/* process options */
-	poptContext optc = poptGetContext("tiffscan", argc, argv, options,
-					  POPT_CONTEXT_POSIXMEHARDER);
+		request = p;
+		memcpy(request + len, arg, n);
+		len += n;
+	}
 
-	mode = process_cmd_line(optc, argc, argv);
+	free(cwd);
 
-	if (mode == MODE_VERSION || verbose > 0) {
-		printf("tiffscan %d.%d (%s); libsane version %d.%d.%d\n",
-		       __VERSION, __REVISION, __DATE__,
-		       SANE_VERSION_MAJOR(version),
-		       SANE_VERSION_MINOR(version),
-		       SANE_VERSION_BUILD(version));
+	if (path == NULL || daemon_address(path, &sun) != 0) {
+		free(request);
+		return 1;
 	}
 
-	if (mode == MODE_VERSION)
-	        goto end;
-
-	if (mode == MODE_STOP)
-		goto end;
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &sun, sizeof(sun)) != 0) {
+		printf("cannot connect to %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		free(request);
+		return 1;
+	}
 
-	/* find a scanner */
-	if (devname == NULL) {
-                devname = find_suitable_device();
+	if (scratch_write(fd, request, len) != 0) {
+		printf("cannot send the scan to %s: %s\n", path,
+		       strerror(errno));
+		close(fd);
+		free(request);
+		return 1;
 	}
 
-	if (devname == NULL && mode == MODE_HELP) {
-		poptPrintHelp(optc, stdout, 0);
-		goto end;
+	free(request);
+	shutdown(fd, SHUT_WR);
+
+	/* output up to the NUL, then the exit code */
+	for (;;) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		char *nul;
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		if (done) {
+			nul = buf;
+		} else {
+			nul = memchr(buf, '\0', n);
+			fwrite(buf, 1, nul ? nul - buf : n, stdout);
+			fflush(stdout);
+			if (nul == NULL)
+				continue;
+			done = 1;
+			nul++;
+		}
+
+		while (nul < buf + n && clen < sizeof(code) - 1)
+			code[clen++] = *nul++;
 	}
 
-	if (devname == NULL) {
-		goto end;
+	close(fd);
+
+	if (!done) {
+		printf("the daemon on %s went away\n", path);
+		return 1;
 	}
 
-	/* open */
-	if (devname[0] == '/') {
+	code[clen] = '\0';
+
+	return atoi(code);
+}
+
+static int
+device_open(struct device *dev, SANE_Int version)
+{
+	SANE_Status status;
+
+	if (dev->name[0] == '/') {
 		printf("\nYou seem to have specified a UNIX device name, "
 		       "or filename instead of selecting\nthe SANE scanner or "
 		       "image acquisition device you want to use. As an example,\n"
@@ -1926,24 +10022,25 @@ main(int argc, const char **argv)
 		       "list with\ntiffscan --list-devices.\n");
 	}
 
-	status = sane_open(devname, &handle);
+	status = sane_open(dev->name, &dev->handle);
 	if (status != SANE_STATUS_GOOD) {
 		printf("failed to open device %s: %s\n",
-		       devname, sane_strstatus(status));
-		goto end;
+		       dev->name, sane_strstatus(status));
+		dev->handle = NULL;
+		return -1;
 	}
 
-	printf("Using %s\n", devname);
+	printf("Using %s\n", dev->name);
 
 #ifdef SANE_HAS_EVOLVED
-	if (sane_has_evolved(handle, version)) {
+	if (sane_has_evolved(dev->handle, version)) {
 		printf("... with SANE Evolution extensions!\n");
 
-		sane_tell_api_level(handle, SANE_API(1, 1, 0));
+		sane_tell_api_level(dev->handle, SANE_API(1, 1, 0));
 
 		memset(&si, 0x00, sizeof(si));
 
-		status = sane_get_scanner_info(handle, &si);
+		status = sane_get_scanner_info(dev->handle, &si);
 		if (status == SANE_STATUS_GOOD) {
 			printf("%s %s (revision: %s, serial: %s)\n",
 				si.vendor, si.model,
@@ -1960,60 +10057,160 @@ main(int argc, const char **argv)
 		"Please check http://code.google.com/p/sane-evolution/\n");*/
 
 #endif
-	/* handle backend options */
-	if (verbose)
-		printf("Setting backend parameters\n");
 
-	mode = process_backend_options(handle, argc, argv, mode);
+	return 0;
+}
+
+int
+main(int argc, const char **argv)
+{
+	int rc = 0, mode = MODE_NONE;
+
+	SANE_Int version;
+	int i, n;
+
+	/* hand the whole command line over to a daemon */
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--connect", 9) == 0)
+			return daemon_connect(argc, argv);
+	}
+
+	atexit(tiffscan_exit);
+
+	paperinit();
+	simd_init();
+
+	sane_init(&version, NULL);
+	cache_version = version;
+
+	/* process options */
+	poptContext optc = poptGetContext("tiffscan", argc, argv, options,
+					  POPT_CONTEXT_POSIXMEHARDER);
+
+	mode = process_cmd_line(optc, argc, argv);
+
+	/* a daemon streams to FIFOs only, its stdout is its log */
+	if (stream_name && !daemon_socket)
+		stream_redirect();
+
+	if (mode == MODE_VERSION || verbose > 0) {
+		printf("tiffscan %d.%d (%s); libsane version %d.%d.%d\n",
+		       __VERSION, __REVISION, __DATE__,
+		       SANE_VERSION_MAJOR(version),
+		       SANE_VERSION_MINOR(version),
+		       SANE_VERSION_BUILD(version));
+	}
+
+	if (mode == MODE_VERSION)
+	        goto end;
+
 	if (mode == MODE_STOP)
 		goto end;
 
-	/* shall we dance? */
-	if (mode != MODE_SCAN) {
-		printf("Use --scan to begin scanning, --help for details.\n");
+	if (daemon_socket && ndevices > 1) {
+		printf("a daemon drives a single device\n");
 		goto end;
 	}
 
-	/* set scanning area size */
-	if (paper) {
-		const struct paper *pi = paperinfo(paper);
+	/* no device needed */
+	if (synthetic || replay_file) {
+		source = replay_file ? &replay_source : &synthetic_source;
 
-		if (pi == NULL) {
-			printf("Unknown paper name: %s\n", paper);
+		if (ndevices > 1) {
+			printf("--%s cannot be used with several devices\n",
+			       replay_file ? "replay" : "synthetic");
+			goto end;
+		}
+
+		if (ndevices == 0
+		    && device_add(strdup(replay_file ? "replay" : "synthetic")) != 0)
+			goto end;
+
+		if (daemon_socket) {
+			rc = daemon_run(daemon_socket);
 			goto end;
 		}
 
-		if (corners[2] == -1 || corners[3] == -1) {
-			printf("Setting scanning area size is not supported on this scanner.\n");
+		if (mode != MODE_SCAN) {
+			printf("Use --scan to begin scanning, --help for details.\n");
 			goto end;
 		}
 
-		set_scanning_area(handle, paperpswidth(pi),
-				  paperpsheight(pi));
+		devices[0].handle = replay_file ? replay_open(replay_file)
+			: synthetic_open(synthetic);
+		if (devices[0].handle == NULL)
+			goto end;
+
+		rc = run_scan();
+		goto end;
 	}
 
-	// switch to output path, if requested
-	if (output_path) {
-		int err = chdir(output_path);
-		if (err != 0) {
-			printf("Cannot switch to %s: %s\n", output_path, strerror(errno));
+	/* find a scanner */
+	if (ndevices == 0) {
+		char *name = find_suitable_device();
+
+		if (name == NULL && mode == MODE_HELP) {
+			poptPrintHelp(optc, stdout, 0);
+			goto end;
+		}
+
+		if (name == NULL || device_add(name) != 0)
 			goto end;
+	}
+
+	/* open */
+	for (n = 0; n < ndevices; n++) {
+		struct device *dev = &devices[n];
+		const char **dargv = argv;
+		int dargc = argc;
+
+		/* a cached option table is enough for --help */
+		if (mode != MODE_HELP || daemon_socket
+		    || device_options(dev) != 0) {
+			if (device_open(dev, version) != 0)
+				goto end;
+		}
+
+		/* handle backend options */
+		if (verbose)
+			printf("Setting backend parameters\n");
+
+		/* each device gets the arguments that follow its --device */
+		if (ndevices > 1) {
+			dargv = device_argv(argc, argv, n, &dargc);
+			if (dargv == NULL) {
+				printf("out of memory\n");
+				goto end;
+			}
+			output_file = NULL;
 		}
+
+		mode = process_backend_options(dev, dargc, dargv, mode);
+
+		if (dargv != argv) {
+			free(dargv);
+			dev->output_file = output_file;
+		}
+
+		if (mode == MODE_STOP)
+			goto end;
 	}
 
-	/* scan */
-	status = scan(handle);
+	if (daemon_socket) {
+		rc = daemon_run(daemon_socket);
+		goto end;
+	}
 
-	if (batch && batch_count == 0 && status == SANE_STATUS_NO_DOCS)
-		rc = 2;
+	/* shall we dance? */
+	if (mode != MODE_SCAN) {
+		printf("Use --scan to begin scanning, --help for details.\n");
+		goto end;
+	}
 
-	if (status != SANE_STATUS_GOOD && status != SANE_STATUS_NO_DOCS
-		&& status != SANE_STATUS_CANCELLED)
-		printf("SANE error: %s\n", sane_strstatus(status));
+	rc = run_scan();
 
 end:
 	poptFreeContext(optc);
-	free(devname);
 
 	exit(rc);
 }